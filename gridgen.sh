@@ -1,6 +1,7 @@
 #!/usr/bin/env bash
 NOTES=$1
 STEPS=$2
+OUTS=${3:-1}
 
 if test -z "$NOTES" -o -z "$STEPS"; then
 	echo "Number of notes and steps must be given."
@@ -17,6 +18,11 @@ if ! [ "$STEPS" -eq "$STEPS" ] 2>/dev/null; then
 	exit 1
 fi
 
+if ! [ "$OUTS" -ge 1 -a "$OUTS" -le 4 ] 2>/dev/null; then
+	echo "Number of Outputs must be an integer 1..4"
+	exit 1
+fi
+
 
 IDX=11
 
@@ -85,6 +91,185 @@ EOF
 	echo '</tr>' >> $MODICON
 done
 
+for ((n=1; n <= $NOTES; n++)); do
+sed "s/@IDX@/$IDX/;s/@NOTE@/$n/g" << EOF
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "chn@NOTE@";
+		lv2:name "Note @NOTE@ Channel";
+		lv2:default -1;
+		lv2:minimum -1;
+		lv2:maximum 15;
+		lv2:portProperty lv2:integer;
+		lv2:scalePoint [ rdfs:label "Global"; rdf:value -1 ; ]
+EOF
+	IDX=$(($IDX + 1))
+done
+
+for ((o=2; o <= $OUTS; o++)); do
+sed "s/@IDX@/$IDX/;s/@OUT@/$o/g" << EOF
+	] , [
+		a atom:AtomPort, lv2:OutputPort;
+		atom:bufferType atom:Sequence;
+		atom:supports midi:MidiEvent;
+		lv2:index @IDX@;
+		lv2:symbol "midiout@OUT@";
+		lv2:name "MIDI Out @OUT@";
+EOF
+	IDX=$(($IDX + 1))
+done
+
+if test "$OUTS" -gt 1; then
+	for ((n=1; n <= $NOTES; n++)); do
+	sed "s/@IDX@/$IDX/;s/@NOTE@/$n/g;s/@OUTS@/$OUTS/g" << EOF
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "out@NOTE@";
+		lv2:name "Note @NOTE@ Output";
+		lv2:default 1;
+		lv2:minimum 1;
+		lv2:maximum @OUTS@;
+		lv2:portProperty lv2:integer
+EOF
+		IDX=$(($IDX + 1))
+	done
+fi
+
+sed "s/@IDX@/$IDX/;s/@OUTS@/$OUTS/g" << EOF
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "clock";
+		lv2:name "MIDI Clock Output";
+		lv2:default 0;
+		lv2:minimum 0;
+		lv2:maximum @OUTS@;
+		lv2:portProperty lv2:integer, lv2:enumeration;
+		lv2:scalePoint [ rdfs:label "Off"; rdf:value 0 ; ] ;
+EOF
+for ((o=1; o <= $OUTS; o++)); do
+	echo "		lv2:scalePoint [ rdfs:label \"MIDI Out $o\"; rdf:value $o ; ] ;"
+done
+IDX=$(($IDX + 1))
+
+sed "s/@IDX@/$IDX/" << EOF
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "seeks";
+		lv2:name "Detected Seeks";
+		lv2:minimum 0;
+		lv2:maximum 65535;
+		lv2:portProperty lv2:integer, pprop:notOnGUI;
+EOF
+IDX=$(($IDX + 1))
+
+sed "s/@IDX@/$IDX/;s/@IDX1@/$(($IDX + 1))/;s/@IDX2@/$(($IDX + 2))/;s/@IDX3@/$(($IDX + 3))/" << EOF
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "lookahead";
+		lv2:name "Latency Compensation";
+		lv2:default 0;
+		lv2:minimum 0;
+		lv2:maximum 8192;
+		lv2:portProperty lv2:integer;
+		units:unit units:frame;
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX1@;
+		lv2:symbol "latmode";
+		lv2:name "Latency Compensation Mode";
+		lv2:default 0;
+		lv2:minimum 0;
+		lv2:maximum 2;
+		lv2:portProperty lv2:integer, lv2:enumeration;
+		lv2:scalePoint [ rdfs:label "Off"; rdf:value 0 ; ] ;
+		lv2:scalePoint [ rdfs:label "Look-ahead"; rdf:value 1 ; ] ;
+		lv2:scalePoint [ rdfs:label "Report to Host"; rdf:value 2 ; ] ;
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX2@;
+		lv2:symbol "latency";
+		lv2:name "Latency";
+		lv2:minimum 0;
+		lv2:maximum 8192;
+		lv2:designation lv2:latency;
+		lv2:portProperty lv2:reportsLatency, lv2:integer, pprop:notOnGUI;
+		units:unit units:frame;
+	] , [
+		a lv2:InputPort, lv2:ControlPort ;
+		lv2:index @IDX3@;
+		lv2:symbol "freewheel";
+		lv2:name "Freewheel";
+		lv2:default 0;
+		lv2:minimum 0;
+		lv2:maximum 1;
+		lv2:designation lv2:freeWheeling;
+		lv2:portProperty lv2:toggled, pprop:notOnGUI;
+EOF
+IDX=$(($IDX + 4))
+
+CNT_SYMBOLS=(notes_on notes_off retriggers panics past_events dropped deferred redundant_off)
+CNT_NAMES=("Note-on Events" "Note-off Events" "Re-triggered Notes" "MIDI Panics" "Late Steps" "Dropped Events" "Deferred Events" "Redundant Note-offs")
+
+for ((c=0; c < ${#CNT_SYMBOLS[@]}; c++)); do
+sed "s/@IDX@/$IDX/;s/@SYMBOL@/${CNT_SYMBOLS[$c]}/;s/@NAME@/${CNT_NAMES[$c]}/" << EOF
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "@SYMBOL@";
+		lv2:name "@NAME@";
+		lv2:minimum 0;
+		lv2:maximum 16777215;
+		lv2:portProperty lv2:integer, pprop:notOnGUI;
+EOF
+IDX=$(($IDX + 1))
+done
+
+if test -n "$INSTRUMENT"; then
+sed "s/@IDX@/$IDX/;s/@IDX1@/$(($IDX + 1))/;s/@IDX2@/$(($IDX + 2))/;s/@IDX3@/$(($IDX + 3))/" << EOF
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX@;
+		lv2:symbol "cycle_p50";
+		lv2:name "Cycle Time Median";
+		lv2:minimum 0;
+		lv2:maximum 1000000;
+		lv2:portProperty pprop:notOnGUI;
+		units:unit [ a units:Unit ; rdfs:label "microseconds" ; units:symbol "us" ; units:render "%.1f us" ] ;
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX1@;
+		lv2:symbol "cycle_p99";
+		lv2:name "Cycle Time 99th Percentile";
+		lv2:minimum 0;
+		lv2:maximum 1000000;
+		lv2:portProperty pprop:notOnGUI;
+		units:unit [ a units:Unit ; rdfs:label "microseconds" ; units:symbol "us" ; units:render "%.1f us" ] ;
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX2@;
+		lv2:symbol "cycle_max";
+		lv2:name "Cycle Time Maximum";
+		lv2:minimum 0;
+		lv2:maximum 1000000;
+		lv2:portProperty pprop:notOnGUI;
+		units:unit [ a units:Unit ; rdfs:label "microseconds" ; units:symbol "us" ; units:render "%.1f us" ] ;
+	] , [
+		a lv2:OutputPort, lv2:ControlPort ;
+		lv2:index @IDX3@;
+		lv2:symbol "events_max";
+		lv2:name "Events per Cycle Maximum";
+		lv2:minimum 0;
+		lv2:maximum 2048;
+		lv2:portProperty lv2:integer, pprop:notOnGUI;
+EOF
+IDX=$(($IDX + 4))
+fi
+
 if test -z "$MOD"; then
 	exit
 fi
@@ -63,6 +63,11 @@ typedef struct {
 	RobTkLbl*    lbl_div;
 	RobTkLbl*    lbl_bpm;
 	RobTkLbl*    lbl_swg;
+#ifdef INSTRUMENT
+	RobTkLbl*    lbl_stats;
+	float        cycle_p99;
+	float        cycle_max;
+#endif
 
 	cairo_pattern_t* swg_bg;
 	cairo_surface_t* bpm_bg;
@@ -698,6 +703,9 @@ static RobWidget* toplevel (SeqUI* ui, void* const top) {
 	ui->lbl_div  = robtk_lbl_new ("Step");
 	ui->lbl_bpm  = robtk_lbl_new ("888.8 BPM");
 	ui->lbl_swg  = robtk_lbl_new ("Swing");
+#ifdef INSTRUMENT
+	ui->lbl_stats = robtk_lbl_new ("-");
+#endif
 
 	/* Layout */
 
@@ -715,6 +723,9 @@ static RobWidget* toplevel (SeqUI* ui, void* const top) {
 	rob_table_attach (ui->ctbl, robtk_pbtn_widget (ui->btn_panic), 8, 10, cr + 0, cr + 1, 2, 0, RTK_EXANDF, RTK_SHRINK);
 	rob_table_attach (ui->ctbl, GSL_W (ui->sel_mchn),              8, 10, cr + 1, cr + 2, 2, 0, RTK_EXANDF, RTK_SHRINK);
 	rob_table_attach (ui->ctbl, robtk_lbl_widget (ui->lbl_chn),    8, 10, cr + 2, cr + 3, 0, 0, RTK_EXANDF, RTK_SHRINK);
+#ifdef INSTRUMENT
+	rob_table_attach (ui->ctbl, robtk_lbl_widget (ui->lbl_stats),  0,  2, cr + 2, cr + 3, 0, 0, RTK_EXANDF, RTK_SHRINK);
+#endif
 
 	/* top-level packing */
 	rob_hbox_child_pack (ui->rw, ui->ctbl, FALSE, TRUE);
@@ -753,6 +764,9 @@ static void gui_cleanup (SeqUI* ui) {
 	robtk_lbl_destroy (ui->lbl_div);
 	robtk_lbl_destroy (ui->lbl_bpm);
 	robtk_lbl_destroy (ui->lbl_swg);
+#ifdef INSTRUMENT
+	robtk_lbl_destroy (ui->lbl_stats);
+#endif
 
 	cairo_surface_destroy (ui->bpm_bg);
 	cairo_pattern_destroy (ui->swg_bg);
@@ -900,6 +914,21 @@ port_event (LV2UI_Handle handle,
 			break;
 		case PORT_PANIC:
 			break;
+#ifdef INSTRUMENT
+		case PORT_CYCLE_P99:
+		case PORT_CYCLE_MAX:
+			{
+				char txt[31];
+				if (port_index == PORT_CYCLE_P99) {
+					ui->cycle_p99 = v;
+				} else {
+					ui->cycle_max = v;
+				}
+				snprintf(txt, 31, "%.1f / %.1f us", ui->cycle_p99, ui->cycle_max);
+				robtk_lbl_set_text (ui->lbl_stats, txt);
+			}
+			break;
+#endif
 		case PORT_STEP:
 			{
 				unsigned int step = rintf (v - 1.f);
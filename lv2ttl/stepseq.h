@@ -10,11 +10,11 @@ static const RtkLv2Description _plugin = {
 	, 0 // uint32_t dsp_descriptor_id
 	, 0 // uint32_t gui_descriptor_id
 	, "MIDI Step Sequencer8x8" // const char *plugin_human_id
-	, (const struct LV2Port[83])
+	, (const struct LV2Port[105])
 	{
 		{ "control", ATOM_IN, nan, nan, nan, "Control Input"},
 		{ "midiout", MIDI_OUT, nan, nan, nan, "MIDI Out"},
-		{ "sync", CONTROL_IN, 0.000000, 0.000000, 1.000000, "Sync"},
+		{ "sync", CONTROL_IN, 0.000000, 0.000000, 2.000000, "Sync"},
 		{ "bpm", CONTROL_IN, 120.000000, 40.000000, 208.000000, "BPM"},
 		{ "div", CONTROL_IN, 3.000000, 0.000000, 9.000000, "Step Duration (4/4)"},
 		{ "swing", CONTROL_IN, 0.000000, 0.000000, 0.500000, "Swing"},
@@ -95,18 +95,40 @@ static const RtkLv2Description _plugin = {
 		{ "grid_6_8", CONTROL_IN, 0.000000, 0.000000, 127.000000, "Grid S: 6 N: 8"},
 		{ "grid_7_8", CONTROL_IN, 0.000000, 0.000000, 127.000000, "Grid S: 7 N: 8"},
 		{ "grid_8_8", CONTROL_IN, 0.000000, 0.000000, 127.000000, "Grid S: 8 N: 8"},
+		{ "chn1", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 1 Channel"},
+		{ "chn2", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 2 Channel"},
+		{ "chn3", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 3 Channel"},
+		{ "chn4", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 4 Channel"},
+		{ "chn5", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 5 Channel"},
+		{ "chn6", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 6 Channel"},
+		{ "chn7", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 7 Channel"},
+		{ "chn8", CONTROL_IN, -1.000000, -1.000000, 15.000000, "Note 8 Channel"},
+		{ "clock", CONTROL_IN, 0.000000, 0.000000, 1.000000, "MIDI Clock Output"},
+		{ "seeks", CONTROL_OUT, nan, 0.000000, 65535.000000, "Detected Seeks"},
+		{ "lookahead", CONTROL_IN, 0.000000, 0.000000, 8192.000000, "Latency Compensation"},
+		{ "latmode", CONTROL_IN, 0.000000, 0.000000, 2.000000, "Latency Compensation Mode"},
+		{ "latency", CONTROL_OUT, nan, 0.000000, 8192.000000, "Latency"},
+		{ "freewheel", CONTROL_IN, 0.000000, 0.000000, 1.000000, "Freewheel"},
+		{ "notes_on", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Note-on Events"},
+		{ "notes_off", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Note-off Events"},
+		{ "retriggers", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Re-triggered Notes"},
+		{ "panics", CONTROL_OUT, nan, 0.000000, 16777215.000000, "MIDI Panics"},
+		{ "past_events", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Late Steps"},
+		{ "dropped", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Dropped Events"},
+		{ "deferred", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Deferred Events"},
+		{ "redundant_off", CONTROL_OUT, nan, 0.000000, 16777215.000000, "Redundant Note-offs"},
 	}
-	, 83 // uint32_t nports_total
+	, 105 // uint32_t nports_total
 	, 0 // uint32_t nports_audio_in
 	, 0 // uint32_t nports_audio_out
 	, 0 // uint32_t nports_midi_in
 	, 1 // uint32_t nports_midi_out
 	, 1 // uint32_t nports_atom_in
 	, 0 // uint32_t nports_atom_out
-	, 81 // uint32_t nports_ctrl
-	, 79 // uint32_t nports_ctrl_in
-	, 2 // uint32_t nports_ctrl_out
+	, 103 // uint32_t nports_ctrl
+	, 91 // uint32_t nports_ctrl_in
+	, 12 // uint32_t nports_ctrl_out
 	, 8192 // uint32_t min_atom_bufsiz
 	, true // bool send_time_info
-	, UINT32_MAX // uint32_t latency_ctrl_port
+	, 95 // uint32_t latency_ctrl_port
 };
@@ -0,0 +1,184 @@
+/* stepseq -- minimal SIMD abstraction for the grid kernels
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The backend is selected at compile time, from the compiler's target
+ * flags, or explicitly by defining SIMD_BACKEND.
+ *
+ * Kernels are named <kernel>_<backend>, and the header can be included
+ * once per backend (tools/simdtest.c compares them to scalar).
+ */
+
+#ifndef SIMD_SCALAR
+#define SIMD_SCALAR 0
+#define SIMD_SSE2   1
+#define SIMD_AVX2   2
+#define SIMD_NEON   3
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** copy `n` control-port values to a contiguous array */
+static inline void
+grid_snapshot (float* dst, float* const* ports, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		dst[i] = *ports[i];
+	}
+}
+#endif
+
+#ifndef SIMD_BACKEND
+# if defined __AVX2__
+#  define SIMD_BACKEND SIMD_AVX2
+# elif defined __SSE2__ || defined _M_X64
+#  define SIMD_BACKEND SIMD_SSE2
+# elif defined __ARM_NEON || defined __ARM_NEON__
+#  define SIMD_BACKEND SIMD_NEON
+# else
+#  define SIMD_BACKEND SIMD_SCALAR
+# endif
+#endif
+
+#if SIMD_BACKEND == SIMD_SCALAR && !defined SIMD_HAVE_SCALAR
+# define SIMD_HAVE_SCALAR
+# define SIMD_FN(name) name##_scalar
+# define SIMD_N 1
+typedef float simd_f_scalar;
+typedef bool  simd_m_scalar;
+# define simd_f              simd_f_scalar
+# define simd_m              simd_m_scalar
+# define simd_load(p)        (*(p))
+# define simd_store(p, v)    (*(p) = (v))
+# define simd_neq(a, b)      (!((a) == (b)))
+# define simd_bits(m)        ((uint32_t)(m))
+# define simd_select(m, a, b) ((m) ? (a) : (b))
+
+#elif SIMD_BACKEND == SIMD_SSE2 && !defined SIMD_HAVE_SSE2
+# define SIMD_HAVE_SSE2
+# include <emmintrin.h>
+# define SIMD_FN(name) name##_sse2
+# define SIMD_N 4
+# define simd_f              __m128
+# define simd_m              __m128
+# define simd_load(p)        _mm_loadu_ps (p)
+# define simd_store(p, v)    _mm_storeu_ps ((p), (v))
+# define simd_neq(a, b)      _mm_cmpneq_ps ((a), (b))
+# define simd_bits(m)        ((uint32_t)_mm_movemask_ps (m))
+# define simd_select(m, a, b) _mm_or_ps (_mm_and_ps ((m), (a)), _mm_andnot_ps ((m), (b)))
+
+#elif SIMD_BACKEND == SIMD_AVX2 && !defined SIMD_HAVE_AVX2
+# define SIMD_HAVE_AVX2
+# include <immintrin.h>
+# define SIMD_FN(name) name##_avx2
+# define SIMD_N 8
+# define simd_f              __m256
+# define simd_m              __m256
+# define simd_load(p)        _mm256_loadu_ps (p)
+# define simd_store(p, v)    _mm256_storeu_ps ((p), (v))
+# define simd_neq(a, b)      _mm256_cmp_ps ((a), (b), _CMP_NEQ_UQ)
+# define simd_bits(m)        ((uint32_t)_mm256_movemask_ps (m))
+# define simd_select(m, a, b) _mm256_blendv_ps ((b), (a), (m))
+
+#elif SIMD_BACKEND == SIMD_NEON && !defined SIMD_HAVE_NEON
+# define SIMD_HAVE_NEON
+# include <arm_neon.h>
+# define SIMD_FN(name) name##_neon
+# define SIMD_N 4
+/* compare the bit-patterns, armv7 NEON flushes denormals to zero */
+static inline uint32x4_t
+simd_neq_neon (float32x4_t a, float32x4_t b)
+{
+	const uint32x4_t ia   = vreinterpretq_u32_f32 (a);
+	const uint32x4_t ib   = vreinterpretq_u32_f32 (b);
+	const uint32x4_t abs  = vdupq_n_u32 (0x7fffffff);
+	const uint32x4_t nan  = vcgtq_u32 (vandq_u32 (ia, abs), vdupq_n_u32 (0x7f800000));
+	const uint32x4_t zero = vceqq_u32 (vandq_u32 (vorrq_u32 (ia, ib), abs), vdupq_n_u32 (0));
+	const uint32x4_t eq   = vorrq_u32 (vbicq_u32 (vceqq_u32 (ia, ib), nan), zero);
+	return vmvnq_u32 (eq);
+}
+
+static inline uint32_t
+simd_bits_neon (uint32x4_t m)
+{
+	static const uint32_t bits[4] = { 1, 2, 4, 8 };
+	m = vandq_u32 (m, vld1q_u32 (bits));
+#ifdef __aarch64__
+	return vaddvq_u32 (m);
+#else
+	const uint32x2_t s = vadd_u32 (vget_low_u32 (m), vget_high_u32 (m));
+	return vget_lane_u32 (vpadd_u32 (s, s), 0);
+#endif
+}
+
+# define simd_f              float32x4_t
+# define simd_m              uint32x4_t
+# define simd_load(p)        vld1q_f32 (p)
+# define simd_store(p, v)    vst1q_f32 ((p), (v))
+# define simd_neq(a, b)      simd_neq_neon ((a), (b))
+# define simd_bits(m)        simd_bits_neon (m)
+# define simd_select(m, a, b) vbslq_f32 ((m), (a), (b))
+#endif
+
+#ifdef SIMD_FN
+
+/**
+ * compare `n` values of `cur` to `seen`, the same as port_changed () for
+ * every value: changed values are copied to `seen`, bit (i % 32) of
+ * changed[i / 32] is set for every changed value i.
+ * @return number of changed values
+ */
+static uint32_t
+SIMD_FN (grid_diff) (const float* cur, float* seen, uint32_t* changed, uint32_t n)
+{
+	uint32_t n_changed = 0;
+	for (uint32_t w = 0; w < n; w += 32) {
+		const uint32_t end = n - w < 32 ? n : w + 32;
+		uint32_t bits = 0;
+		uint32_t i = w;
+		for (; i + SIMD_N <= end; i += SIMD_N) {
+			const simd_f c = simd_load (&cur[i]);
+			const simd_f s = simd_load (&seen[i]);
+			const simd_m m = simd_neq (c, s);
+			const uint32_t b = simd_bits (m);
+			if (b) {
+				simd_store (&seen[i], simd_select (m, c, s));
+				bits |= b << (i - w);
+			}
+		}
+		for (; i < end; ++i) {
+			if (!(cur[i] == seen[i])) {
+				seen[i] = cur[i];
+				bits |= 1u << (i - w);
+			}
+		}
+		changed[w / 32] = bits;
+		n_changed += __builtin_popcount (bits);
+	}
+	return n_changed;
+}
+
+# undef SIMD_FN
+# undef SIMD_N
+# undef simd_f
+# undef simd_m
+# undef simd_load
+# undef simd_store
+# undef simd_neq
+# undef simd_bits
+# undef simd_select
+#endif
@@ -24,27 +24,86 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <math.h>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#if defined INSTRUMENT || defined TRACE
+#include <time.h>
+#endif
+
 #ifdef HAVE_LV2_1_18_6
 #include <lv2/atom/atom.h>
 #include <lv2/atom/forge.h>
 #include <lv2/core/lv2.h>
 #include <lv2/log/logger.h>
 #include <lv2/midi/midi.h>
+#include <lv2/patch/patch.h>
+#include <lv2/state/state.h>
 #include "lv2/time/time.h"
 #include <lv2/urid/urid.h>
+#include <lv2/worker/worker.h>
 #else
 #include <lv2/lv2plug.in/ns/lv2core/lv2.h>
 #include <lv2/lv2plug.in/ns/ext/atom/atom.h>
 #include <lv2/lv2plug.in/ns/ext/atom/forge.h>
 #include <lv2/lv2plug.in/ns/ext/log/logger.h>
 #include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/patch/patch.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
 #include "lv2/lv2plug.in/ns/ext/time/time.h"
 #include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
 #endif
 
 #include "stepseq.h"
+#include "simd.h"
+
+#if SIMD_BACKEND == SIMD_AVX2
+#define grid_diff grid_diff_avx2
+#elif SIMD_BACKEND == SIMD_SSE2
+#define grid_diff grid_diff_sse2
+#elif SIMD_BACKEND == SIMD_NEON
+#define grid_diff grid_diff_neon
+#else
+#define grid_diff grid_diff_scalar
+#endif
+
+#ifndef MAX_EVENTS
+#define MAX_EVENTS 2048 // max midi events per cycle (all ports)
+#endif
+
+#define STATE_VERSION 2
+
+#define SEEK_PPQN      1920 // resolution of the seek detection
+#define SEEK_TOLERANCE 60   // max deviation of host position in ticks (1/128 note), before assuming a seek
+#define SEEK_DRIFT     120  // .. while following a deviation, so that jitter near the tolerance is not a seek
+#define SEEK_SLEW      (1.0 / 16) // max correction when following the host, in samples per sample
+
+#define MIN_BPM   1.f    // tempo range, for both the BPM port and host tempo
+#define MAX_BPM   1000.f
+#define MAX_BEATS 1e9    // host positions beyond this are ignored
+
+/* loop position and step duration are kept on a 1/65536 sample grid.
+ * Adding and subtracting whole samples is then exact, and event
+ * positions do not depend on how the host splits time into cycles.
+ */
+#define TIME_GRID 65536.0
+
+/* event counters, published on output ports PORT_NOTES_ON .. PORT_REDUNDANT_OFF.
+ * The values wrap at 2^24 to remain exact as float */
+#define N_COUNTERS (PORT_REDUNDANT_OFF - PORT_NOTES_ON + 1)
+#define COUNT(port) (++self->counters[(port) - PORT_NOTES_ON])
+
+#define CACHE_LINE 64
+#ifdef __GNUC__
+#define CACHE_ALIGN __attribute__ ((aligned (CACHE_LINE)))
+#else
+#define CACHE_ALIGN
+#endif
 
 typedef struct {
 	LV2_URID atom_Blank;
@@ -54,6 +113,14 @@ typedef struct {
 	LV2_URID atom_Float;
 	LV2_URID atom_Int;
 	LV2_URID atom_Long;
+	LV2_URID atom_Chunk;
+	LV2_URID atom_Path;
+	LV2_URID atom_URID;
+	LV2_URID patch_Set;
+	LV2_URID patch_property;
+	LV2_URID patch_value;
+	LV2_URID state_pattern;
+	LV2_URID state_smf;
 	LV2_URID time_Position;
 	LV2_URID time_bar;
 	LV2_URID time_barBeat;
@@ -64,9 +131,143 @@ typedef struct {
 } StepSeqURIs;
 
 typedef struct {
+	uint32_t time;
+	uint8_t  port;
+	uint8_t  size;
+	uint8_t  buf[3];
+} StepSeqEvent;
+
+/* pattern, edited using control ports, saved and restored as a whole */
+typedef struct {
+	uint8_t note[N_NOTES];           // MIDI note-number
+	int8_t  chn[N_NOTES];            // MIDI channel, -1: global
+	uint8_t out[N_NOTES];            // output port
+	uint8_t vel[N_NOTES * N_STEPS];  // velocity, 0: off
+} StepSeqPattern;
+
+/* last seen control-port values */
+typedef struct {
+	float note[N_NOTES];
+	float chn[N_NOTES];
+	float out[N_NOTES];
+	float grid[N_NOTES * N_STEPS];
+} StepSeqPorts;
+
+typedef struct {
+	/* DLL, times are in samples */
+	double  t0;      // filtered time of the last tick
+	double  t1;      // predicted time of the next tick
+	double  e2;      // tick period
+	double  b, c;    // DLL coefficients
+	double  t_init;  // time of the first tick after (re)init
+	double  s_x;     // sums for the line fit until the DLL engages, relative to t_init
+	double  s_ix;
+	int     n_ticks; // ticks since (re)init: 0: none, 1: period unknown, MCLK_AVERAGE: locked
+	int64_t lost;    // ticks assumed lost before the last tick
+
+	/* transport */
+	bool    running; // between start/continue and stop
+	int64_t pos;     // song-position of the last tick (24 PPQN)
+	int64_t pending; // song-position of the next tick, after start/continue/SPP; -1: none
+} MidiClockSlave;
+
+#ifdef INSTRUMENT
+#define STATS_BINS 96 // cycle cost histogram, 4 bins per octave, 64ns .. 1s
+
+/* per-cycle cost, collected over a window of about one second */
+typedef struct {
+	uint32_t hist[STATS_BINS];
+	uint32_t n_cycles;
+	uint64_t n_samples;  // duration of the window
+	uint64_t max_ns;
+	uint32_t max_events;
+	uint32_t n_out;      // events written in the current cycle
+
+	/* results of the previous window, in usec */
+	float p50;
+	float p99;
+	float max;
+	float events;
+} StepSeqStats;
+#endif
+
+#ifdef TRACE
+#define TRACE_SIZE 8192 // trace records, power of two
+
+enum {
+	TRACE_RUN = 0,   // arg: n_samples
+	TRACE_POSITION,  // update_position
+	TRACE_BEAT,      // beat_machine, arg: step
+	TRACE_PANIC,     // midi_panic
+	TRACE_SORT,      // sort queued events, arg: number of events
+	TRACE_SEEK,      // instant, arg: step after the seek
+	TRACE_N_KINDS
+};
+
+typedef struct {
+	uint64_t frame; // sample-time at the start of the cycle
+	uint64_t t0;    // CLOCK_MONOTONIC, nsec
+	uint32_t cycle;
+	uint32_t dur;   // nsec, 0: instant
+	uint32_t kind;
+	uint32_t arg;
+} StepSeqTraceRecord;
+
+/* ring-buffer, oldest records are overwritten. It is read in-process by
+ * the host between cycles (tools/render.c) */
+typedef struct {
+	StepSeqTraceRecord rec[TRACE_SIZE];
+	uint32_t head;  // number of records written, wraps around
+	uint32_t cycle; // number of run() calls
+	uint64_t frame;
+} StepSeqTrace;
+#endif
+
+/* The instance is allocated aligned to CACHE_LINE. State used every cycle
+ * comes first and is kept compact, followed by the output queue, the
+ * pattern and grid ports, and data used only when instantiating, for
+ * state save/restore or for diagnostics.
+ */
+typedef struct {
+	/* State */
+	double   stme CACHE_ALIGN; // sample-time, on TIME_GRID
+	double   stme_err; // accumulated sps_err, at most half a TIME_GRID unit
+	double   sps; // samples per step, on TIME_GRID
+	double   sps_err; // rounding error of sps
+	double   swing;
+	double   sample_rate; // samples per second
+	uint64_t sample_count;
+	int32_t  step; // current step
+	uint32_t lookahead; // render events early by this many samples (synced only)
+	uint32_t n_events;
+	uint32_t n_carried; // events carried over from the previous cycle
+	uint32_t seeks;
+
+	/* Cached Port */
+	float bpm; // beats per minute
+	float div; // beats per step
+
+	uint8_t  chn;  // midi channel
+	bool     rolling;
+	bool     drift; // following a deviation from the host position
+	bool     drum_mode;
+	bool     resync; // take current port-values as seen, after state restore
+	bool     imported; // pattern is from a MIDI file, not from the ports, saved with the state
+
+	/* Host Time */
+	int      sync_mode; // 0: free running, 1: host, 2: MIDI clock
+	bool     host_info;
+	float    host_bpm;   // in quarter-notes per minute
+	float    host_tempo; // the host's BPM in its beat-unit, reported as is
+	float    host_speed;
+	double   bar_beats;
+	double   host_beats;  // bar_beats at the last position update
+	uint64_t host_frames; // samples since the last position update
+	double   host_bar; // bar duration in quarter-notes
+
 	/* ports */
 	const LV2_Atom_Sequence* ctrl_in;
-	LV2_Atom_Sequence* midiout;
+	LV2_Atom_Sequence* midiout[N_OUTS];
 	float* p_sync;
 	float* p_bpm;
 	float* p_div;
@@ -76,54 +277,116 @@ typedef struct {
 	float* p_panic;
 	float* p_step;
 	float* p_hostbpm;
+	float* p_clock;
+	float* p_seeks;
+	float* p_lookahead;
+	float* p_latmode;
+	float* p_latency;
+	float* p_freewheel;
 
-	float* p_note[N_NOTES];
-	float* p_grid[N_NOTES * N_STEPS];
+	uint8_t  notes[N_NOTES];
+	uint8_t  dests[N_NOTES]; // per row destination: output-port * 16 + midi channel
+
+	/* MIDI Clock */
+	int      clk_port;    // output port, -1: off
+	bool     clk_rolling;
+	bool     clk_start;   // send SPP + start/continue with next tick
+	bool     clk_sync;    // clock follows host position
+	int64_t  clk_next;    // next tick to send (24 PPQN)
+	int64_t  clk_anchor;  // tick at anchor
+	double   clk_offset;  // sample-time of anchor tick
+	double   clk_spt;     // samples per tick
+	uint64_t clk_frames;  // samples since anchor
+
+	/* MIDI Clock input */
+	MidiClockSlave mclk;
+
+	uint32_t counters[N_COUNTERS];
+	float*   p_counter[N_COUNTERS];
+
+	/* Output, queued events for all ports */
+	LV2_Atom_Forge       forge[N_OUTS] CACHE_ALIGN;
+	LV2_Atom_Forge_Frame frame[N_OUTS];
+	uint8_t              active[N_OUTS * 16][128];
+	StepSeqEvent         events[MAX_EVENTS];
+
+	/* Pattern */
+	StepSeqPattern pattern CACHE_ALIGN;
+	float*         p_note[N_NOTES];
+	float*         p_rowchn[N_NOTES];
+#if N_OUTS > 1
+	float*         p_rowout[N_NOTES];
+#endif
+	float*         p_grid[N_NOTES * N_STEPS];
+	StepSeqPorts   seen;
+	float          snapshot[N_NOTES * N_STEPS]; // grid port-values, this cycle
 
 	/* atom-forge and URI mapping */
-	LV2_URID_Map* map;
+	LV2_URID_Map* map CACHE_ALIGN;
 	StepSeqURIs uris;
-	LV2_Atom_Forge forge;
-	LV2_Atom_Forge_Frame frame;
 
 	/* LV2 Output */
 	LV2_Log_Log* log;
 	LV2_Log_Logger logger;
 
-	/* Cached Port */
-	float bpm; // beats per minute
-	float div; // beats per step
-
-	/* Settings */
-	double sample_rate; // samples per second
-	double sps; // samples per step
+	/* Worker */
+	LV2_Worker_Schedule* schedule;
 
-	double swing;
-	bool   drum_mode;
+#ifdef TRACE
+	StepSeqTrace trace;
+#endif
+#ifdef INSTRUMENT
+	StepSeqStats stats;
+	float* p_cycle_p50;
+	float* p_cycle_p99;
+	float* p_cycle_max;
+	float* p_events_max;
+#endif
+} StepSeq;
 
-	/* Host Time */
-	bool     host_info;
-	float    host_bpm;
-	double   bar_beats;
-	float    host_speed;
-	int      host_div;
+#define NSET(note, step) (self->pattern.vel[ (note) * N_STEPS + (step) ] > 0)
+#define NVEL(note, step) (self->pattern.vel[ (note) * N_STEPS + (step) ])
+#define ACTV(dest, note) (self->active[dest][note] > 0)
+#define NOTE(note) (self->notes[note])
+#define DEST(note) (self->dests[note])
 
-	/* State */
-	double   stme; // sample-time
-	int32_t  step; // current step
-	uint8_t  chn;  // midi channel
 
-	uint8_t  notes[N_NOTES];
-	uint8_t  active[128];
-	bool     rolling;
+/* *****************************************************************************
+ * Tracing
+ */
 
-} StepSeq;
+#if defined INSTRUMENT || defined TRACE
+static inline uint64_t
+monotonic_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
 
-#define NSET(note, step) (*self->p_grid[ (note) * N_STEPS + (step) ] > 0)
-#define NVEL(note, step) ((int)floor(*self->p_grid[ (note) * N_STEPS + (step) ]))
-#define ACTV(note) (self->active[note] > 0)
-#define NOTE(note) (self->notes[note])
+#ifdef TRACE
+static void
+trace_push (StepSeq* self, uint32_t kind, uint32_t arg, uint64_t t0, uint64_t dur)
+{
+	StepSeqTraceRecord* r = &self->trace.rec[self->trace.head & (TRACE_SIZE - 1)];
+	r->frame = self->trace.frame;
+	r->t0    = t0;
+	r->cycle = self->trace.cycle;
+	r->dur   = dur < UINT32_MAX ? dur : UINT32_MAX;
+	r->kind  = kind;
+	r->arg   = arg;
+	++self->trace.head;
+}
 
+#define TRACE_BEGIN() const uint64_t trace_t0 = monotonic_ns ()
+#define TRACE_END(kind, arg) trace_push (self, kind, arg, trace_t0, monotonic_ns () - trace_t0)
+#define TRACE_INSTANT(kind, arg) trace_push (self, kind, arg, monotonic_ns (), 0)
+#else
+#define TRACE_BEGIN()
+#define TRACE_END(kind, arg)
+#define TRACE_INSTANT(kind, arg)
+#endif
 
 /* *****************************************************************************
  * helper functions
@@ -141,6 +404,14 @@ map_mem_uris (LV2_URID_Map* map, StepSeqURIs* uris)
 	uris->atom_Long           = map->map (map->handle, LV2_ATOM__Long);
 	uris->atom_Int            = map->map (map->handle, LV2_ATOM__Int);
 	uris->atom_Float          = map->map (map->handle, LV2_ATOM__Float);
+	uris->atom_Chunk          = map->map (map->handle, LV2_ATOM__Chunk);
+	uris->atom_Path           = map->map (map->handle, LV2_ATOM__Path);
+	uris->atom_URID           = map->map (map->handle, LV2_ATOM__URID);
+	uris->patch_Set           = map->map (map->handle, LV2_PATCH__Set);
+	uris->patch_property      = map->map (map->handle, LV2_PATCH__property);
+	uris->patch_value         = map->map (map->handle, LV2_PATCH__value);
+	uris->state_pattern       = map->map (map->handle, STATE_URI "#pattern");
+	uris->state_smf           = map->map (map->handle, STATE_URI "#smf");
 	uris->time_bar            = map->map (map->handle, LV2_TIME__bar);
 	uris->time_barBeat        = map->map (map->handle, LV2_TIME__barBeat);
 	uris->time_beatUnit       = map->map (map->handle, LV2_TIME__beatUnit);
@@ -149,6 +420,49 @@ map_mem_uris (LV2_URID_Map* map, StepSeqURIs* uris)
 	uris->time_speed          = map->map (map->handle, LV2_TIME__speed);
 }
 
+/** limit the tempo to the supported range, NaN maps to the default */
+static inline float
+clamp_bpm (float bpm)
+{
+	if (isnan (bpm)) {
+		return 120.f;
+	}
+	return bpm < MIN_BPM ? MIN_BPM : bpm > MAX_BPM ? MAX_BPM : bpm;
+}
+
+/**
+ * Set the current position, tempo and transport-speed.
+ * This is used for both host time:Position and MIDI clock.
+ *
+ * The position `beats`, tempo `bpm` and `beats_per_bar` are in units of `beat_unit`
+ * (4: quarter-note, 8: eighth-note, ...). Step durations are specified in
+ * quarter-notes, so both are mapped to quarter-notes here.
+ */
+static void
+set_host_position (StepSeq* self, float bpm, float speed, double beats, float beats_per_bar, int beat_unit)
+{
+	const double q = (beat_unit > 0 && beat_unit <= 128) ? 4.0 / beat_unit : 1.0;
+	self->host_bar    = (beats_per_bar > 0 && beats_per_bar <= 128) ? beats_per_bar * q : 4.0;
+	self->host_bpm    = clamp_bpm (bpm * q);
+	self->host_tempo  = clamp_bpm (bpm);
+	self->host_speed  = speed;
+	self->bar_beats   = beats * q;
+	self->host_beats  = self->bar_beats;
+	self->host_frames = 0;
+	self->host_info   = true;
+}
+
+/**
+ * Advance the position by `n_samples` until the next update.
+ * It is calculated from the last update, rounding errors do not accumulate.
+ */
+static void
+advance_host_position (StepSeq* self, uint32_t n_samples)
+{
+	self->host_frames += n_samples;
+	self->bar_beats = self->host_beats + (double)self->host_frames * self->host_bpm * self->host_speed / (60.0 * self->sample_rate);
+}
+
 /**
  * Update the current position based on a host message. This is called by
  * run() when a time:Position is received.
@@ -157,6 +471,7 @@ static void
 update_position (StepSeq* self, const LV2_Atom_Object* obj)
 {
 	const StepSeqURIs* uris = &self->uris;
+	TRACE_BEGIN ();
 
 	LV2_Atom* bar   = NULL;
 	LV2_Atom* beat  = NULL;
@@ -185,20 +500,197 @@ update_position (StepSeq* self, const LV2_Atom_Object* obj)
 		float    _bpb   = ((LV2_Atom_Float*)bpb)->body;
 		int64_t  _bar   = ((LV2_Atom_Long*)bar)->body;
 		float    _beat  = ((LV2_Atom_Float*)beat)->body;
+		float    _bpm   = ((LV2_Atom_Float*)bpm)->body;
+		float    _speed = ((LV2_Atom_Float*)speed)->body;
+		double   beats  = _bar * (double)_bpb + _beat;
 
-		self->host_div   = ((LV2_Atom_Int*)bunit)->body;
-		self->host_bpm   = ((LV2_Atom_Float*)bpm)->body;
-		self->host_speed = ((LV2_Atom_Float*)speed)->body;
+		/* ignore invalid positions, keep the last valid one */
+		if (fabs (beats) < MAX_BEATS && _bpm > 0 && isfinite (_speed)) {
+			set_host_position (self, _bpm, _speed, beats, _bpb, ((LV2_Atom_Int*)bunit)->body);
+		}
+	}
+	TRACE_END (TRACE_POSITION, 0);
+}
+
+/* *****************************************************************************
+ * MIDI Clock input
+ *
+ * The tick-period and phase are estimated using a 2nd order DLL,
+ * see Fons Adriaensen, "Using a DLL to filter time", LAC 2005.
+ */
+
+#define MCLK_BANDWIDTH 0.2 // DLL bandwidth in Hz
+#define MCLK_TIMEOUT   0.5 // consider the clock lost after this many seconds without a tick
+#define MCLK_AVERAGE   48  // fit period and phase to this many ticks before engaging the DLL
+#define MCLK_MAX_ERR   0.25 // re-init if a tick deviates more than this fraction of a period
+
+static void
+mclk_reset (MidiClockSlave* mc)
+{
+	mc->n_ticks = 0;
+	mc->running = false;
+	mc->pos     = 0;
+	mc->pending = -1;
+	mc->e2      = 0;
+	mc->lost    = 0;
+}
 
-		self->bar_beats  = _bar * _bpb + _beat; // * host_div / 4.0 // TODO map host metrum
-		self->host_info  = true;
+/**
+ * process a clock tick received at time `t`.
+ * @param period_hint period to assume, when no period is known
+ */
+static void
+mclk_tick (MidiClockSlave* mc, double t, double period_hint, double sample_rate)
+{
+	int64_t lost = 0;
+	if (mc->n_ticks > 1 && fabs (t - mc->t1) > MCLK_MAX_ERR * mc->e2) {
+		const double late = (t - mc->t1) / mc->e2;
+		lost = llrint (late);
+		if (mc->n_ticks >= MCLK_AVERAGE && lost > 0 && mc->lost == 0 && fabs (late - lost) <= MCLK_MAX_ERR) {
+			/* dropout, the tick is on the grid: count the lost ticks */
+			mc->t1 += lost * mc->e2;
+		} else {
+			/* tempo jump, also when two ticks in a row are late: the
+			 * previous one was not a dropout either. re-init */
+			if (mc->running && mc->pending < 0) {
+				mc->pos -= mc->lost;
+			}
+			lost = 0;
+			mc->n_ticks = 0;
+			/* until the next tick, the last interval is the best guess */
+			mc->e2 = t > mc->t0 ? t - mc->t0 : 0;
+		}
+	}
+	mc->lost = lost;
+
+	if (mc->n_ticks >= MCLK_AVERAGE) {
+		const double e = t - mc->t1;
+		mc->t0  = mc->t1;
+		mc->t1 += mc->b * e + mc->e2;
+		mc->e2 += mc->c * e;
+	} else if (mc->n_ticks > 0) {
+		/* least-squares fit of a line to the ticks since (re)init,
+		 * tick i = 0 .. n - 1 at time t_init + x_i */
+		const double n = ++mc->n_ticks;
+		const double x = t - mc->t_init;
+		mc->s_x  += x;
+		mc->s_ix += (n - 1) * x;
+		const double s_i  = n * (n - 1) / 2;
+		const double s_ii = n * (n - 1) * (2 * n - 1) / 6;
+		mc->e2 = (n * mc->s_ix - s_i * mc->s_x) / (n * s_ii - s_i * s_i);
+		mc->t0 = mc->t_init + (mc->s_x - mc->e2 * s_i) / n + mc->e2 * (n - 1);
+		mc->t1 = mc->t0 + mc->e2;
+		if (mc->n_ticks == MCLK_AVERAGE) {
+			const double omega = 2.0 * M_PI * MCLK_BANDWIDTH * mc->e2 / sample_rate;
+			mc->b = sqrt (2.0) * omega;
+			mc->c = omega * omega;
+		}
+	} else {
+		if (mc->e2 <= 0) {
+			mc->e2 = period_hint;
+		}
+		mc->t_init = t;
+		mc->t0 = t;
+		mc->t1 = t + mc->e2;
+		mc->s_x  = 0;
+		mc->s_ix = 0;
+		mc->n_ticks = 1;
+	}
+
+	if (mc->running) {
+		if (mc->pending >= 0) {
+			mc->pos = mc->pending;
+			mc->pending = -1;
+		} else {
+			mc->pos += 1 + lost;
+		}
+	}
+}
+
+/** process a MIDI system real-time or SPP message received at time `t` */
+static void
+mclk_message (MidiClockSlave* mc, double t, const uint8_t* msg, uint32_t size, double period_hint, double sample_rate)
+{
+	switch (msg[0]) {
+		case 0xf8: // clock
+			mclk_tick (mc, t, period_hint, sample_rate);
+			break;
+		case 0xfa: // start
+			mc->running = true;
+			mc->pending = 0;
+			break;
+		case 0xfb: // continue
+			mc->running = true;
+			mc->pending = mc->pending >= 0 ? mc->pending : mc->pos + 1;
+			break;
+		case 0xfc: // stop
+			mc->running = false;
+			break;
+		case 0xf2: // song position pointer (in 16th notes)
+			if (size == 3) {
+				mc->pending = 6 * (int64_t)((msg[1] & 0x7f) | ((msg[2] & 0x7f) << 7));
+			}
+			break;
+		default:
+			break;
 	}
 }
+
 /**
- * add a midi message to the output port
+ * query position at time `t`, for a cycle until `t_end`
+ * @param ticks song-position in ticks (24 PPQN)
+ * @param period tick-period in samples, 0 if unknown
+ * @return true if the clock is rolling
+ */
+static bool
+mclk_position (MidiClockSlave* mc, double t, double t_end, double sample_rate, double* ticks, double* period)
+{
+	/* do not play past the timeout, even if the cycle is long */
+	if (mc->n_ticks > 0 && t_end - mc->t0 > MCLK_TIMEOUT * sample_rate) {
+		/* clock lost */
+		mc->n_ticks = 0;
+		mc->running = false;
+	}
+
+	const double dt = mc->t1 - mc->t0;
+	*period = mc->n_ticks > 0 && dt > 0 && mc->e2 > 0 ? mc->e2 : 0;
+
+	if (!mc->running || *period == 0 || mc->pending >= 0) {
+		*ticks = mc->pending >= 0 ? mc->pending : mc->pos;
+		return false;
+	}
+
+	*ticks = mc->pos + (t - mc->t0) / dt;
+	return true;
+}
+/**
+ * queue a midi message for the given output port.
+ * Events are written to the port-buffers by flush_events()
  */
 static void
 forge_midimessage (StepSeq* self,
+                   uint8_t port,
+                   uint32_t ts,
+                   const uint8_t* const buffer,
+                   uint32_t size)
+{
+	if (self->n_events >= MAX_EVENTS || size > 3) {
+		COUNT (PORT_DROPPED);
+		return;
+	}
+	StepSeqEvent* ev = &self->events[self->n_events++];
+	ev->time = ts;
+	ev->port = port;
+	ev->size = size;
+	memcpy (ev->buf, buffer, size);
+}
+
+/**
+ * add a midi message to the output port
+ */
+static void
+write_midimessage (StepSeq* self,
+                   LV2_Atom_Forge* forge,
                    uint32_t ts,
                    const uint8_t* const buffer,
                    uint32_t size)
@@ -207,10 +699,96 @@ forge_midimessage (StepSeq* self,
 	midiatom.type = self->uris.midi_MidiEvent;
 	midiatom.size = size;
 
-	if (0 == lv2_atom_forge_frame_time (&self->forge, ts)) return;
-	if (0 == lv2_atom_forge_raw (&self->forge, &midiatom, sizeof (LV2_Atom))) return;
-	if (0 == lv2_atom_forge_raw (&self->forge, buffer, size)) return;
-	lv2_atom_forge_pad (&self->forge, sizeof (LV2_Atom) + size);
+	if (   0 == lv2_atom_forge_frame_time (forge, ts)
+	    || 0 == lv2_atom_forge_raw (forge, &midiatom, sizeof (LV2_Atom))
+	    || 0 == lv2_atom_forge_raw (forge, buffer, size)) {
+		COUNT (PORT_DROPPED);
+		return;
+	}
+	lv2_atom_forge_pad (forge, sizeof (LV2_Atom) + size);
+}
+
+/**
+ * event order, system messages (MIDI clock) precede channel messages
+ * at the same time. Events carried over from the previous cycle then
+ * retain the same order as events queued in the current cycle.
+ */
+static inline bool
+event_before (const StepSeqEvent* a, const StepSeqEvent* b)
+{
+	if (a->time != b->time) {
+		return a->time < b->time;
+	}
+	return a->buf[0] >= 0xf0 && b->buf[0] < 0xf0;
+}
+
+/**
+ * sort queued events by time and write them to the output ports.
+ * Events at or after `n_samples` are kept for the next cycle.
+ */
+static void
+flush_events (StepSeq* self, uint32_t n_samples)
+{
+	StepSeqEvent* ev = self->events;
+	TRACE_BEGIN ();
+
+	/* events are queued in order, except for re-trigger note-offs
+	 * (ts - 1) in drum-mode. Use a stable insertion sort, so that
+	 * the order of events at the same time is retained.
+	 */
+	for (uint32_t i = 1; i < self->n_events; ++i) {
+		if (!event_before (&ev[i], &ev[i - 1])) {
+			continue;
+		}
+		const StepSeqEvent tmp = ev[i];
+		uint32_t j = i;
+		do {
+			ev[j] = ev[j - 1];
+			--j;
+		} while (j > 0 && event_before (&tmp, &ev[j - 1]));
+		ev[j] = tmp;
+	}
+	TRACE_END (TRACE_SORT, self->n_events);
+
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		const uint32_t capacity = self->midiout[p]->atom.size;
+		lv2_atom_forge_set_buffer (&self->forge[p], (uint8_t*)self->midiout[p], capacity);
+		lv2_atom_forge_sequence_head (&self->forge[p], &self->frame[p], 0);
+	}
+
+	uint32_t i;
+	for (i = 0; i < self->n_events && ev[i].time < n_samples; ++i) {
+		write_midimessage (self, &self->forge[ev[i].port], ev[i].time, ev[i].buf, ev[i].size);
+	}
+#ifdef INSTRUMENT
+	self->stats.n_out = i;
+#endif
+
+	uint32_t n_later = 0;
+	for (; i < self->n_events; ++i, ++n_later) {
+		ev[n_later] = ev[i];
+		ev[n_later].time -= n_samples;
+	}
+	self->n_events  = n_later;
+	self->n_carried = n_later;
+	self->counters[PORT_DEFERRED - PORT_NOTES_ON] += n_later;
+}
+
+static void
+report_counters (StepSeq* self)
+{
+	for (uint32_t i = 0; i < N_COUNTERS; ++i) {
+		*self->p_counter[i] = self->counters[i] & 0xffffff;
+	}
+}
+
+/** discard events that were carried over from the previous cycle */
+static void
+drop_carried_events (StepSeq* self)
+{
+	memmove (self->events, &self->events[self->n_carried], (self->n_events - self->n_carried) * sizeof (StepSeqEvent));
+	self->n_events -= self->n_carried;
+	self->n_carried = 0;
 }
 
 static void
@@ -218,62 +796,517 @@ midi_panic (StepSeq* self)
 {
 	uint8_t event[3];
 	event[2] = 0;
-
-	for (uint32_t c = 0; c < 0xf; ++c) {
-		event[0] = 0xb0 | c;
-		event[1] = 0x40; // sustain pedal
-		forge_midimessage (self, 0, event, 3);
-		event[1] = 0x7b; // all notes off
-		forge_midimessage (self, 0, event, 3);
+	TRACE_BEGIN ();
+	COUNT (PORT_PANICS);
+
+	/* notes of a step at the start of this cycle are not played */
+	drop_carried_events (self);
+
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		for (uint32_t c = 0; c <= 0xf; ++c) {
+			event[0] = 0xb0 | c;
+			event[1] = 0x40; // sustain pedal
+			forge_midimessage (self, p, 0, event, 3);
+			event[1] = 0x7b; // all notes off
+			forge_midimessage (self, p, 0, event, 3);
 #if 0
-		event[1] = 0x78; // all sound off
-		forge_midimessage (self, 0, event, 3);
+			event[1] = 0x78; // all sound off
+			forge_midimessage (self, p, 0, event, 3);
 #endif
+		}
+	}
+	TRACE_END (TRACE_PANIC, 0);
+}
+
+static void
+forge_note_event (StepSeq* self, uint32_t ts, uint8_t dest, uint8_t note, uint8_t vel)
+{
+	uint8_t msg[3];
+	if (vel > 0) {
+		if (ACTV (dest, note)) {
+			++self->active[dest][note];
+			return;
+		}
+		++self->active[dest][note];
+		msg[0] = 0x90;
+	} else {
+		if (!ACTV (dest, note)) {
+			lv2_log_error (&self->logger, "StepSeq.lv2: Note-off for a note that's already off\n");
+			COUNT (PORT_REDUNDANT_OFF);
+			return;
+		}
+		--self->active[dest][note];
+		msg[0] = 0x80;
+	}
+	COUNT (vel > 0 ? PORT_NOTES_ON : PORT_NOTES_OFF);
+
+	msg[0] |= dest & 0xf;
+	msg[1]  = note & 0x7f;
+	msg[2]  = vel & 0x7f;
+	forge_midimessage (self, dest >> 4, ts, msg, 3);
+}
+
+static inline double
+snap_time (double t)
+{
+	return rint (t * TIME_GRID) / TIME_GRID;
+}
+
+/* *****************************************************************************
+ * MIDI Clock
+ */
+
+static void
+clock_stop (StepSeq* self)
+{
+	if (self->clk_rolling && self->clk_port >= 0) {
+		const uint8_t msg = 0xfc; // stop
+		forge_midimessage (self, self->clk_port, 0, &msg, 1);
+	}
+	self->clk_rolling = false;
+}
+
+/**
+ * (re)start the clock at the given position (in ticks).
+ * Starting is deferred to the next MIDI beat (16th note),
+ * which is announced with a Song Position Pointer.
+ */
+static void
+clock_locate (StepSeq* self, double pos)
+{
+	clock_stop (self);
+	self->clk_next    = 6 * (int64_t)ceil (pos / 6.0);
+	self->clk_start   = true;
+	self->clk_rolling = true;
+}
+
+/**
+ * set the clock timebase: the next tick (clk_next) is due `t` samples
+ * from now, subsequent ticks follow every `spt` samples.
+ */
+static void
+clock_anchor (StepSeq* self, double t, double spt)
+{
+	self->clk_anchor = self->clk_next;
+	self->clk_offset = snap_time (t);
+	self->clk_spt    = spt;
+	self->clk_frames = 0;
+}
+
+/** sample-time of the next tick, relative to the current cycle start */
+static double
+clock_time (StepSeq* self)
+{
+	return self->clk_offset + (self->clk_next - self->clk_anchor) * self->clk_spt - self->clk_frames;
+}
+
+static void
+clock_run (StepSeq* self, uint32_t n_samples, double t, double spt)
+{
+	uint8_t msg[3];
+
+	for (uint32_t i = 0;; ++i) {
+		const double   tt = snap_time (t + i * spt);
+		const uint32_t ts = tt > 0 ? floor (tt) : 0;
+		if (tt >= n_samples) {
+			break;
+		}
+		if (self->clk_start) {
+			const int64_t spp = self->clk_next / 6;
+			msg[0] = 0xf2;
+			msg[1] = spp & 0x7f;
+			msg[2] = (spp >> 7) & 0x7f;
+			forge_midimessage (self, self->clk_port, ts, msg, 3);
+			msg[0] = spp == 0 ? 0xfa : 0xfb; // start, continue
+			forge_midimessage (self, self->clk_port, ts, msg, 1);
+			self->clk_start = false;
+		}
+		msg[0] = 0xf8;
+		forge_midimessage (self, self->clk_port, ts, msg, 1);
+		++self->clk_next;
+	}
+}
+
+/**
+ * send MIDI clock for the current cycle.
+ *
+ * @param pos clock position in ticks at the start of the cycle
+ * @param spt samples per tick
+ * @param locate position changed, send a new song-position
+ * @param follow re-align the clock to `pos` if it drifts by more than a sample
+ *
+ * Every tick is placed using its exact position relative to the last
+ * (re)alignment, independent of the cycle-size.
+ */
+static void
+clock_process (StepSeq* self, uint32_t n_samples, double pos, double spt, bool locate, bool follow)
+{
+	if (!self->clk_rolling || locate) {
+		clock_locate (self, pos);
+		clock_anchor (self, (self->clk_next - pos) * spt, spt);
+	} else if (spt != self->clk_spt) {
+		/* tempo change, retain phase of the next tick */
+		clock_anchor (self, clock_time (self) * spt / self->clk_spt, spt);
+	} else if (follow && fabs (clock_time (self) - (self->clk_next - pos) * spt) > 1.0) {
+		clock_anchor (self, (self->clk_next - pos) * spt, spt);
+	}
+
+	clock_run (self, n_samples, clock_time (self), spt);
+	self->clk_frames += n_samples;
+}
+
+/**
+ * convert a rounded control-port value to an integer in the range [lo, hi].
+ * Hosts may send any value, NaN maps to `lo`.
+ */
+static inline int
+port_int (float v, int lo, int hi)
+{
+	if (!(v > lo)) {
+		return lo;
+	}
+	return v > hi ? hi : (int)v;
+}
+
+/**
+ * map the division port-value to a step duration in quarter-notes.
+ * Multi-bar divisions use `bar`, the duration of a bar in quarter-notes.
+ */
+static float
+parse_division (float div, double bar) {
+	const int d = port_int (rintf (div), -1, 10);
+	switch (d) {
+		case 0: return 0.125f;
+		case 1: return 0.25f;
+		case 2: return 0.5f;
+		case 3: return 1.f;
+		case 4: return 2.f;
+		case 5: return 3.f;
+		case 6: return 4.f;
+		case 7: return 2 * bar;
+		case 8: return 3 * bar;
+		case 9: return 4 * bar;
+	}
+	return 1.f;
+}
+
+/* *****************************************************************************
+ * Pattern
+ */
+
+static uint8_t
+parse_velocity (float v)
+{
+	if (!(v > 0)) {
+		return 0;
+	}
+	return v < 1 ? 1 : v > 127 ? 127 : (uint8_t)floorf (v);
+}
+
+static uint8_t
+parse_note (float v)
+{
+	return port_int (floorf (v), 0, 127);
+}
+
+static int8_t
+parse_channel (float v)
+{
+	const int rc = port_int (floorf (v), -1, 16);
+	return (rc < 0 || rc > 15) ? -1 : rc;
+}
+
+static uint8_t
+parse_output (float v)
+{
+	const int ro = port_int (floorf (v), 0, N_OUTS + 1) - 1;
+	return (ro < 0 || ro >= N_OUTS) ? 0 : ro;
+}
+
+/** check if a control-port value changed, and remember the new value */
+static inline bool
+port_changed (float* seen, const float* port)
+{
+	if (*port == *seen) {
+		return false;
+	}
+	*seen = *port;
+	return true;
+}
+
+/** set the complete pattern from the last seen control-port values */
+static void
+pattern_from_ports (StepSeq* self)
+{
+	StepSeqPattern*     p = &self->pattern;
+	const StepSeqPorts* s = &self->seen;
+
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		p->note[n] = parse_note (s->note[n]);
+		p->chn[n]  = parse_channel (s->chn[n]);
+#if N_OUTS > 1
+		p->out[n]  = parse_output (s->out[n]);
+#endif
+	}
+	for (uint32_t i = 0; i < N_NOTES * N_STEPS; ++i) {
+		p->vel[i] = parse_velocity (s->grid[i]);
+	}
+}
+
+/**
+ * apply changed control-port values to the pattern.
+ * Comparing to the last seen value allows for the pattern to be
+ * restored using the state interface, independent of port-values.
+ *
+ * An imported MIDI file is not reflected in the ports, the ports win:
+ * the first edit after an import sets the complete pattern from the ports.
+ */
+static void
+pattern_update (StepSeq* self)
+{
+	StepSeqPattern* p = &self->pattern;
+	StepSeqPorts*   s = &self->seen;
+	const bool resync = self->resync;
+	bool edited = false;
+	self->resync = false;
+
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		if (port_changed (&s->note[n], self->p_note[n]) && !resync) {
+			p->note[n] = parse_note (s->note[n]);
+			edited = true;
+		}
+		if (port_changed (&s->chn[n], self->p_rowchn[n]) && !resync) {
+			p->chn[n] = parse_channel (s->chn[n]);
+			edited = true;
+		}
+#if N_OUTS > 1
+		if (port_changed (&s->out[n], self->p_rowout[n]) && !resync) {
+			p->out[n] = parse_output (s->out[n]);
+			edited = true;
+		}
+#endif
+	}
+
+	/* the grid is compared as a whole, usually nothing changed */
+	uint32_t changed[(N_NOTES * N_STEPS + 31) / 32];
+	grid_snapshot (self->snapshot, self->p_grid, N_NOTES * N_STEPS);
+	if (grid_diff (self->snapshot, s->grid, changed, N_NOTES * N_STEPS) > 0 && !resync) {
+		for (uint32_t w = 0; w < sizeof (changed) / sizeof (changed[0]); ++w) {
+			for (uint32_t bits = changed[w]; bits; bits &= bits - 1) {
+				const uint32_t i = w * 32 + __builtin_ctz (bits);
+				p->vel[i] = parse_velocity (s->grid[i]);
+			}
+		}
+		edited = true;
+	}
+
+	if (edited && self->imported) {
+		self->imported = false;
+		pattern_from_ports (self);
+	}
+}
+
+/* *****************************************************************************
+ * Standard MIDI File import
+ *
+ * The file is read and parsed in the worker thread, the resulting pattern
+ * is passed back to be applied in work_response. It replaces the pattern
+ * until the next edit of a pattern control-port, see pattern_update ().
+ */
+
+#define SMF_MAX_SIZE (16 * 1024 * 1024)
+
+typedef struct {
+	StepSeqPattern pattern; // current pattern, note-numbers of unused rows are retained
+	float          div;     // step duration in quarter-notes
+	char           path[1024];
+} SMFRequest;
+
+static uint32_t
+smf_be (const uint8_t* p, int len)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < len; ++i) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static uint32_t
+smf_varlen (const uint8_t** p, const uint8_t* end)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < 4 && *p < end; ++i) {
+		const uint8_t c = *(*p)++;
+		v = (v << 7) | (c & 0x7f);
+		if (!(c & 0x80)) {
+			break;
+		}
+	}
+	return v;
+}
+
+/**
+ * parse a type 0 or 1 SMF and quantise note-on events to the grid.
+ * The most frequently used note-numbers are assigned to rows, in
+ * ascending order.
+ * @return 0 on success
+ */
+static int
+smf_parse (const uint8_t* data, size_t size, float div, StepSeqPattern* pat)
+{
+	uint8_t  vel[128][N_STEPS];
+	uint32_t count[128];
+	memset (vel, 0, sizeof (vel));
+	memset (count, 0, sizeof (count));
+
+	if (size < 14 || memcmp (data, "MThd", 4) || smf_be (data + 4, 4) < 6) {
+		return -1;
+	}
+
+	const uint32_t format = smf_be (data + 8, 2);
+	const uint32_t ntrks  = smf_be (data + 10, 2);
+	const uint32_t ppqn   = smf_be (data + 12, 2);
+
+	if (format > 1 || ppqn == 0 || (ppqn & 0x8000)) {
+		/* type 2 and SMPTE timecode are not supported */
+		return -1;
+	}
+
+	/* check the header length before forming a pointer past it */
+	const uint32_t hdr_len = smf_be (data + 4, 4);
+	if (hdr_len > size - 8) {
+		return -1;
+	}
+
+	const double ticks_per_step = ppqn * div;
+	const uint8_t* const end = data + size;
+	const uint8_t* p = data + 8 + hdr_len;
+
+	for (uint32_t trk = 0; trk < ntrks && (size_t)(end - p) >= 8; ++trk) {
+		const bool     mtrk = !memcmp (p, "MTrk", 4);
+		const uint32_t len  = smf_be (p + 4, 4);
+		p += 8;
+		if (len > (size_t)(end - p)) {
+			return -1;
+		}
+		const uint8_t* const te = p + len;
+		uint64_t tick   = 0;
+		uint8_t  status = 0;
+
+		while (mtrk && p < te) {
+			tick += smf_varlen (&p, te);
+			if (p >= te) {
+				break;
+			}
+			if (*p & 0x80) {
+				status = *p++;
+			}
+			if (status == 0xff) {
+				/* meta event: type, length, data */
+				if (p >= te) {
+					break;
+				}
+				++p;
+				const uint32_t l = smf_varlen (&p, te);
+				p += l < (size_t)(te - p) ? l : (size_t)(te - p);
+				status = 0;
+				continue;
+			}
+			if (status == 0xf0 || status == 0xf7) {
+				/* sysex: length, data */
+				const uint32_t l = smf_varlen (&p, te);
+				p += l < (size_t)(te - p) ? l : (size_t)(te - p);
+				status = 0;
+				continue;
+			}
+			if (status < 0x80) {
+				/* data without running status */
+				return -1;
+			}
+			const uint32_t n_data = ((status & 0xe0) == 0xc0) ? 1 : 2;
+			if (n_data > (size_t)(te - p)) {
+				break;
+			}
+			if ((status & 0xf0) == 0x90 && p[1] > 0) {
+				const double step = floor (tick / ticks_per_step + .5);
+				if (step < N_STEPS) {
+					const uint8_t  note = p[0] & 0x7f;
+					const uint32_t s    = step;
+					++count[note];
+					if (p[1] > vel[note][s]) {
+						vel[note][s] = p[1] & 0x7f;
+					}
+				}
+			}
+			p += n_data;
+		}
+		p = te;
+	}
+
+	/* pick the most used notes */
+	bool use[128];
+	memset (use, 0, sizeof (use));
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		int best = -1;
+		for (int k = 0; k < 128; ++k) {
+			if (!use[k] && count[k] > 0 && (best < 0 || count[k] > count[best])) {
+				best = k;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		use[best] = true;
+	}
+
+	uint32_t row = 0;
+	for (int k = 0; k < 128; ++k) {
+		if (!use[k]) {
+			continue;
+		}
+		pat->note[row] = k;
+		memcpy (&pat->vel[row * N_STEPS], vel[k], N_STEPS);
+		++row;
+	}
+	if (row == 0) {
+		return -1;
 	}
+	memset (&pat->vel[row * N_STEPS], 0, (N_NOTES - row) * N_STEPS);
+	return 0;
 }
 
+/** handle a patch:Set message, schedule SMF import */
 static void
-forge_note_event (StepSeq* self, uint32_t ts, uint8_t note, uint8_t vel)
+parse_patch_set (StepSeq* self, const LV2_Atom_Object* obj)
 {
-	uint8_t msg[3];
-	if (vel > 0) {
-		if (ACTV (note)) {
-			++self->active[note];
-			return;
-		}
-		++self->active[note];
-		msg[0] = 0x90;
-	} else {
-		if (!ACTV (note)) {
-			lv2_log_error (&self->logger, "StepSeq.lv2: Note-off for a note that's already off\n");
-			return;
-		}
-		--self->active[note];
-		msg[0] = 0x80;
-	}
+	const LV2_Atom* property = NULL;
+	const LV2_Atom* value    = NULL;
 
-	msg[0] |= self->chn;
-	msg[1]  = note & 0x7f;
-	msg[2]  = vel & 0x7f;
-	forge_midimessage (self, ts, msg, 3);
-}
+	lv2_atom_object_get (obj,
+			self->uris.patch_property, &property,
+			self->uris.patch_value, &value,
+			0);
 
-static float
-parse_division (float div) {
-	int d = rintf (div);
-	switch (d) {
-		case 0: return 0.125f;
-		case 1: return 0.25f;
-		case 2: return 0.5f;
-		case 3: return 1.f;
-		case 4: return 2.f;
-		case 5: return 3.f;
-		case 6: return 4.f;
-		case 7: return 8.f;
-		case 8: return 12.f;
-		case 9: return 16.f;
+	if (!property || property->type != self->uris.atom_URID
+			|| ((const LV2_Atom_URID*)property)->body != self->uris.state_smf) {
+		return;
 	}
-	return 1.f;
+	if (!value || value->type != self->uris.atom_Path || value->size == 0) {
+		return;
+	}
+
+	SMFRequest req;
+	if (!self->schedule || value->size >= sizeof (req.path)) {
+		return;
+	}
+
+	req.pattern = self->pattern;
+	req.div     = self->div;
+	memcpy (req.path, LV2_ATOM_BODY_CONST (value), value->size);
+	req.path[value->size] = '\0';
+
+	self->schedule->schedule_work (self->schedule->handle, offsetof (SMFRequest, path) + value->size + 1, &req);
 }
 
 /* *****************************************************************************
@@ -283,37 +1316,38 @@ parse_division (float div) {
 static void
 reset_note_tracker (StepSeq* self)
 {
-	for (uint32_t i = 0; i < 127; ++i) {
-		self->active[i] = 0;
-	}
+	memset (self->active, 0, sizeof (self->active));
 }
 
 static void
 beat_machine (StepSeq* self, uint32_t ts, uint32_t step)
 {
+	TRACE_BEGIN ();
 	for (uint32_t n = 0; n < N_NOTES; ++n) {
 		const uint8_t note = NOTE (n);
+		const uint8_t dest = DEST (n);
 		if (note > 127) {
 			continue;
 		}
 
-		if (NSET (n, step) && ACTV (note) && self->drum_mode) {
+		if (NSET (n, step) && ACTV (dest, note) && self->drum_mode) {
 			/* retrigger */
+			COUNT (PORT_RETRIGGERS);
 			if (ts > 0) {
-				forge_note_event (self, ts - 1, note, 0);
-				forge_note_event (self, ts, note, NVEL(n, step));
+				forge_note_event (self, ts - 1, dest, note, 0);
+				forge_note_event (self, ts, dest, note, NVEL(n, step));
 			} else {
-				forge_note_event (self, ts, note, 0);
-				forge_note_event (self, ts + 1, note, NVEL(n, step));
+				forge_note_event (self, ts, dest, note, 0);
+				forge_note_event (self, ts + 1, dest, note, NVEL(n, step));
 			}
 		}
-		else if (NSET (n, step) && !ACTV (note)) {
+		else if (NSET (n, step) && !ACTV (dest, note)) {
 			/* send note on */
-			forge_note_event (self, ts, note, NVEL(n, step));
+			forge_note_event (self, ts, dest, note, NVEL(n, step));
 		}
-		else if (!NSET (n, step) && ACTV (note)) {
+		else if (!NSET (n, step) && ACTV (dest, note)) {
 			/* send note off */
-			forge_note_event (self, ts, note, 0);
+			forge_note_event (self, ts, dest, note, 0);
 		}
 		else if (step == 0 && NSET (n, 0)) {
 			/* re-trigger note if it's always on on the first beat. */
@@ -325,16 +1359,34 @@ beat_machine (StepSeq* self, uint32_t ts, uint32_t step)
 				}
 			}
 			if (retriger) {
+				COUNT (PORT_RETRIGGERS);
 				if (ts > 0) {
-					forge_note_event (self, ts - 1, note, 0);
-					forge_note_event (self, ts, note, NVEL(n, step));
+					forge_note_event (self, ts - 1, dest, note, 0);
+					forge_note_event (self, ts, dest, note, NVEL(n, step));
 				} else {
-					forge_note_event (self, ts, note, 0);
-					forge_note_event (self, ts + 1, note, NVEL(n, step));
+					forge_note_event (self, ts, dest, note, 0);
+					forge_note_event (self, ts + 1, dest, note, NVEL(n, step));
 				}
 			}
 		}
 	}
+	TRACE_END (TRACE_BEAT, step);
+}
+
+/**
+ * Set the step duration for the current tempo and division.
+ * sps is on TIME_GRID, the rounding error is compensated for with every
+ * step, so that steps do not drift during long playback.
+ */
+static void
+update_sps (StepSeq* self)
+{
+	double sps = self->sample_rate * 60.0 * self->div / self->bpm;
+	if (sps < 64) { sps = 64; }
+	if (sps > 60 * self->sample_rate) { sps = 60 * self->sample_rate; }
+	self->sps      = snap_time (sps);
+	self->sps_err  = sps - self->sps;
+	self->stme_err = 0;
 }
 
 static double
@@ -356,13 +1408,44 @@ calc_next_step (StepSeq* self) {
  * LV2 Plugin
  */
 
+/** allocate a zero-initialized instance, aligned to CACHE_LINE */
+static StepSeq*
+stepseq_alloc (void)
+{
+	void* p;
+#ifdef _WIN32
+	p = _aligned_malloc (sizeof (StepSeq), CACHE_LINE);
+#else
+	if (posix_memalign (&p, CACHE_LINE, sizeof (StepSeq))) {
+		p = NULL;
+	}
+#endif
+	if (p) {
+		memset (p, 0, sizeof (StepSeq));
+	}
+	return (StepSeq*)p;
+}
+
+static void
+stepseq_free (StepSeq* self)
+{
+#ifdef _WIN32
+	_aligned_free (self);
+#else
+	free (self);
+#endif
+}
+
 static LV2_Handle
 instantiate (const LV2_Descriptor*     descriptor,
              double                    rate,
              const char*               bundle_path,
              const LV2_Feature* const* features)
 {
-	StepSeq* self = (StepSeq*)calloc (1, sizeof (StepSeq));
+	StepSeq* self = stepseq_alloc ();
+	if (!self) {
+		return NULL;
+	}
 
 	int i;
 	for (i=0; features[i]; ++i) {
@@ -370,6 +1453,8 @@ instantiate (const LV2_Descriptor*     descriptor,
 			self->map = (LV2_URID_Map*)features[i]->data;
 		} else if (!strcmp (features[i]->URI, LV2_LOG__log)) {
 			self->log = (LV2_Log_Log*)features[i]->data;
+		} else if (!strcmp (features[i]->URI, LV2_WORKER__schedule)) {
+			self->schedule = (LV2_Worker_Schedule*)features[i]->data;
 		}
 	}
 
@@ -377,20 +1462,34 @@ instantiate (const LV2_Descriptor*     descriptor,
 
 	if (!self->map) {
 		lv2_log_error (&self->logger, "StepSeq.lv2 error: Host does not support urid:map\n");
-		free (self);
+		stepseq_free (self);
 		return NULL;
 	}
 
-	lv2_atom_forge_init (&self->forge, self->map);
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		lv2_atom_forge_init (&self->forge[p], self->map);
+	}
+	mclk_reset (&self->mclk);
 	map_mem_uris (self->map, &self->uris);
 
 	self->sample_rate = rate;
 	self->bpm = 120.f;
 	self->div = .5f;
-	self->sps = self->sample_rate * 60.0 * self->div / self->bpm;
+	update_sps (self);
 
 	self->step = N_STEPS - 1;
 	self->stme = N_STEPS * self->sps;
+	self->clk_port = -1;
+	self->host_bar = 4.0;
+
+	/* apply all port-values in the first cycle */
+	float* seen = (float*)&self->seen;
+	for (uint32_t i = 0; i < sizeof (StepSeqPorts) / sizeof (float); ++i) {
+		seen[i] = NAN;
+	}
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		self->pattern.chn[n] = -1;
+	}
 
 	reset_note_tracker (self);
 
@@ -409,7 +1508,7 @@ connect_port (LV2_Handle instance,
 			self->ctrl_in = (const LV2_Atom_Sequence*)data;
 			break;
 		case PORT_MIDI_OUT:
-			self->midiout = (LV2_Atom_Sequence*)data;
+			self->midiout[0] = (LV2_Atom_Sequence*)data;
 			break;
 		case PORT_SYNC:
 			self->p_sync = (float*)data;
@@ -445,51 +1544,161 @@ connect_port (LV2_Handle instance,
 			else if (port < PORT_NOTES + N_NOTES + N_NOTES * N_STEPS) {
 				self->p_grid[port - PORT_NOTES - N_NOTES] = (float*)data;
 			}
+			else if (port < PORT_ROWCHN + N_NOTES) {
+				self->p_rowchn[port - PORT_ROWCHN] = (float*)data;
+			}
+			else if (port < PORT_MIDI_OUTS + N_OUTS - 1) {
+				self->midiout[1 + port - PORT_MIDI_OUTS] = (LV2_Atom_Sequence*)data;
+			}
+#if N_OUTS > 1
+			else if (port < PORT_ROWOUT + N_NOTES) {
+				self->p_rowout[port - PORT_ROWOUT] = (float*)data;
+			}
+#endif
+			else if (port == PORT_CLOCK) {
+				self->p_clock = (float*)data;
+			}
+			else if (port == PORT_SEEKS) {
+				self->p_seeks = (float*)data;
+			}
+			else if (port == PORT_LOOKAHEAD) {
+				self->p_lookahead = (float*)data;
+			}
+			else if (port == PORT_LATMODE) {
+				self->p_latmode = (float*)data;
+			}
+			else if (port == PORT_LATENCY) {
+				self->p_latency = (float*)data;
+			}
+			else if (port == PORT_FREEWHEEL) {
+				self->p_freewheel = (float*)data;
+			}
+			else if (port >= PORT_NOTES_ON && port <= PORT_REDUNDANT_OFF) {
+				self->p_counter[port - PORT_NOTES_ON] = (float*)data;
+			}
+#ifdef INSTRUMENT
+			else if (port == PORT_CYCLE_P50) {
+				self->p_cycle_p50 = (float*)data;
+			}
+			else if (port == PORT_CYCLE_P99) {
+				self->p_cycle_p99 = (float*)data;
+			}
+			else if (port == PORT_CYCLE_MAX) {
+				self->p_cycle_max = (float*)data;
+			}
+			else if (port == PORT_EVENTS_MAX) {
+				self->p_events_max = (float*)data;
+			}
+#endif
 			break;
 	}
 }
 
 static void
-run (LV2_Handle instance, uint32_t n_samples)
+process (StepSeq* self, uint32_t n_samples)
 {
-	StepSeq* self = (StepSeq*)instance;
-	if (!self->midiout || !self->ctrl_in) {
+	if (!self->ctrl_in) {
 		return;
 	}
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		if (!self->midiout[p]) {
+			return;
+		}
+	}
+
+	const uint64_t now = self->sample_count;
+	self->sample_count += n_samples;
+
+	pattern_update (self);
+
+	/* while the host exports faster than realtime, nobody watches the GUI */
+	const bool freewheel = *self->p_freewheel > 0;
+
+	const int sync_mode = port_int (rintf (*self->p_sync), 0, 2);
+	if (sync_mode != self->sync_mode) {
+		if (sync_mode == 2 || self->sync_mode == 2) {
+			self->host_info = false;
+		}
+		self->sync_mode = sync_mode;
+	}
 
-	const uint32_t capacity = self->midiout->atom.size;
-	lv2_atom_forge_set_buffer (&self->forge, (uint8_t*)self->midiout, capacity);
-	lv2_atom_forge_sequence_head (&self->forge, &self->frame, 0);
+	/* latency compensation, either report latency to the host or render early */
+	const int   latmode   = port_int (rintf (*self->p_latmode), 0, 2);
+	const float latency   = *self->p_lookahead > 0 ? rintf (fminf (*self->p_lookahead, 8192)) : 0;
+	const uint32_t lookahead = latmode == 1 ? latency : 0;
+	const bool  relocate  = lookahead != self->lookahead;
+	self->lookahead = lookahead;
+	*self->p_latency = latmode == 2 ? latency : 0;
+
+	/* MIDI clock, until a tick is received assume the BPM set by the user */
+	const double period_hint = self->sample_rate * 60.0 / (24.0 * clamp_bpm (*self->p_bpm));
 
 	/* process control events */
 	LV2_Atom_Event* ev = lv2_atom_sequence_begin (&(self->ctrl_in)->body);
 	while (!lv2_atom_sequence_is_end (&(self->ctrl_in)->body, (self->ctrl_in)->atom.size, ev)) {
 		if (ev->body.type == self->uris.atom_Blank || ev->body.type == self->uris.atom_Object) {
 			const LV2_Atom_Object* obj = (LV2_Atom_Object*)&ev->body;
-			if (obj->body.otype == self->uris.time_Position) {
+			if (obj->body.otype == self->uris.time_Position && sync_mode != 2) {
 				update_position (self, obj);
 			}
+			else if (obj->body.otype == self->uris.patch_Set) {
+				parse_patch_set (self, obj);
+			}
+		}
+		else if (ev->body.type == self->uris.midi_MidiEvent && ev->body.size > 0 && sync_mode == 2) {
+			const uint8_t* const data = (const uint8_t*)(ev + 1);
+			mclk_message (&self->mclk, now + ev->time.frames, data, ev->body.size, period_hint, self->sample_rate);
 		}
 		ev = lv2_atom_sequence_next (ev);
 	}
 
+	if (sync_mode == 2) {
+		double ticks, period;
+		const bool rolling = mclk_position (&self->mclk, now, now + n_samples, self->sample_rate, &ticks, &period);
+		if (period > 0) {
+			set_host_position (self, self->sample_rate * 60.0 / (24.0 * period), rolling ? 1 : 0, ticks / 24.0, 4, 4);
+		} else {
+			/* no clock yet, or lost: a slave never plays on its own, hold the position */
+			set_host_position (self, self->host_info ? self->host_tempo : clamp_bpm (*self->p_bpm), 0, ticks / 24.0, 4, 4);
+		}
+	}
+
+	const uint8_t chn = port_int (floorf (*self->p_chn), 0, 15);
+	if (chn != self->chn || *self->p_panic > 0) {
+		self->chn = chn;
+		midi_panic (self);
+		reset_note_tracker (self);
+	}
+
+	int clk = port_int (floorf (*self->p_clock), 0, N_OUTS + 1) - 1;
+	if (clk >= N_OUTS) {
+		clk = -1;
+	}
+	if (clk != self->clk_port || *self->p_panic > 0) {
+		clock_stop (self);
+		self->clk_port = clk;
+	}
+
 	for (uint32_t n = 0; n < N_NOTES; ++n) {
-		uint8_t note = ((int)floorf (*self->p_note[n])) & 0x7f;
-		if (self->notes[n] == note) {
+		const uint8_t note = self->pattern.note[n];
+		const int8_t  rc   = self->pattern.chn[n];
+		const uint8_t dest = self->pattern.out[n] * 16 + (rc < 0 ? chn : rc);
+		if (self->notes[n] == note && self->dests[n] == dest) {
 			continue;
 		}
-		if (NOTE (n) < 128 && ACTV (NOTE (n))) {
-			forge_note_event (self, 0, NOTE (n), 0);
+		if (NOTE (n) < 128 && ACTV (DEST (n), NOTE (n))) {
+			forge_note_event (self, 0, DEST (n), NOTE (n), 0);
 		}
 		bool in_use = false;
 		for (uint32_t n2 = 0; n2 < N_NOTES; ++n2) {
 			if (n2 == n) {
 				continue;
 			}
-			if (self->notes[n2] == note) {
+			if (self->notes[n2] == note && self->dests[n2] == dest) {
 				in_use = true;
 			}
 		}
+		self->dests[n] = dest;
 		if (in_use) {
 			self->notes[n] = 255;
 		} else {
@@ -497,50 +1706,53 @@ run (LV2_Handle instance, uint32_t n_samples)
 		}
 	}
 
-	const uint8_t chn = ((int)floorf (*self->p_chn)) & 0xf;
-	if (chn != self->chn || *self->p_panic > 0) {
-		self->chn = chn;
-		midi_panic (self);
-		reset_note_tracker (self);
-	}
-
 	if (*self->p_panic > 0) {
 		self->step = N_STEPS - 1;
 		self->stme = N_STEPS * self->sps;
 	}
 
 	float bpm;
+	const bool synced = self->host_info && self->sync_mode > 0;
 
-	if (self->host_info && *self->p_sync > 0) {
-		*self->p_hostbpm = self->host_bpm;
+	if (synced) {
+		if (!freewheel) {
+			*self->p_hostbpm = self->host_tempo;
+		}
 		if (self->host_speed <= 0) {
 			/* keep track of host position.. */
-			self->bar_beats += (double)n_samples * self->host_bpm * self->host_speed / (60.0 * self->sample_rate);
+			advance_host_position (self, n_samples);
 			/* report only, don't modify state  (stme & step need to remain in sync) */
-			*self->p_step = 1 + ((int)floor (self->bar_beats / self->div) % N_STEPS);
+			if (!freewheel) {
+				const double hp = floor (self->bar_beats / self->div);
+				*self->p_step = 1 + (int)(hp - N_STEPS * floor (hp / N_STEPS));
+			}
+			*self->p_seeks = self->seeks;
 
 			if (self->rolling) {
 				self->rolling = false;
 				midi_panic (self);
 				reset_note_tracker (self);
 			}
+			clock_stop (self);
+			flush_events (self, n_samples);
+			report_counters (self);
 			return;
 		}
 		bpm = self->host_bpm * self->host_speed;
 	} else {
-		*self->p_hostbpm = self->host_info ? -1 : 0;
-		bpm = *self->p_bpm;
+		if (!freewheel) {
+			*self->p_hostbpm = self->host_info ? -1 : 0;
+		}
+		bpm = clamp_bpm (*self->p_bpm);
 	}
 
-	const float division = parse_division (*self->p_div);
+	const float division = parse_division (*self->p_div, synced ? self->host_bar : 4.0);
 	if (bpm != self->bpm || division != self->div) {
 		const double old = self->sps;
 		self->bpm = bpm;
 		self->div = division;
-		self->sps = self->sample_rate * 60.0 * self->div / self->bpm;
-		if (self->sps < 64) { self->sps = 64; }
-		if (self->sps > 60 * self->sample_rate) { self->sps = 60 * self->sample_rate; }
-		self->stme = fmod (self->stme * self->sps / old, N_STEPS * self->sps);
+		update_sps (self);
+		self->stme = snap_time (fmod (self->stme * self->sps / old, N_STEPS * self->sps));
 	}
 
 	const double sps = self->sps;
@@ -549,46 +1761,105 @@ run (LV2_Handle instance, uint32_t n_samples)
 
 	self->drum_mode = *self->p_drum > 0;
 	self->swing = *self->p_swing;
-	if (self->swing < 0) {
+	if (!(self->swing > 0)) {
 		self->swing = 0;
 	}
 	if (self->swing > 0.5) {
 		self->swing = 0.5;
 	}
 
-	if (self->host_info && *self->p_sync > 0) {
-		double hp = self->bar_beats / self->div;
+	bool locate = synced != self->clk_sync || relocate;
+	bool preroll = false;
+
+	/* synced position, including look-ahead */
+	const double beats = self->bar_beats + (synced ? self->lookahead * self->host_bpm * self->host_speed / (60.0 * self->sample_rate) : 0);
+
+	if (synced) {
+		const double hp = beats / self->div;
+
+		/* host position in steps, positive modulo, positions before the start are rolled in */
+		const double hs = hp - N_STEPS * floor (hp / N_STEPS);
 
-		stme = fmod (hp, N_STEPS) * sps;
+		/* deviation from the expected position, wrapped around the loop */
+		double dev = hs - self->stme / sps;
+		dev -= N_STEPS * floor (dev / N_STEPS + .5);
+		const int64_t dev_ticks = llrint (dev * self->div * SEEK_PPQN);
 
 		/* handle seek - jumps to step if needed */
-		const double ns = calc_next_step (self);
-		if (ns < stme || ns - stme > 1.5 /* max swing*/ * sps || !self->rolling) {
+		if (!self->rolling || locate || llabs (dev_ticks) > (self->drift ? SEEK_DRIFT : SEEK_TOLERANCE)) {
+			const double s = floor (hs);
 
-			if (floor (hp) == hp) {
-				assert (stme == 0);
-				/* immediate transition to step 0 */
-				self->step = N_STEPS - 1;
-				self->stme = stme = N_STEPS * self->sps;
+			stme = snap_time (hs * sps);
+			self->stme_err = 0;
 
+			/* when starting, steps in the look-ahead window are played immediately */
+			preroll = !self->rolling && s != hs && (hs - s) * sps <= self->lookahead;
+
+			if (s == hs || preroll) {
+				/* immediate transition to the step */
+				self->step = ((int)s + N_STEPS - 1) % N_STEPS;
+				if (s == 0) {
+					stme += loop_duration;
+				}
+			} else {
+				self->step = (int)s % N_STEPS;
+			}
+
+			if (self->rolling) {
+				if (!locate) {
+					++self->seeks;
+					TRACE_INSTANT (TRACE_SEEK, self->step);
+				}
+				midi_panic (self);
+				reset_note_tracker (self);
+			}
+			locate = true;
+			self->drift = false;
+		} else if (fabs (dev * sps) > 1.0) {
+			/* follow host, small deviations are due to rounding or jitter.
+			 * The correction per cycle is limited. One that crosses a step
+			 * locates to the step, which is then played at the start of the cycle.
+			 */
+			const double slew = n_samples * SEEK_SLEW;
+			const double corr = fmax (-slew, fmin (slew, dev * sps));
+			const double next = calc_next_step (self);
+			if (corr > 0 && stme + corr > next) {
+				stme = floor (next * TIME_GRID) / TIME_GRID;
 			} else {
-				self->step = ((int)floor (hp) % N_STEPS);
+				stme = snap_time (stme + corr);
 			}
+			self->drift = true;
+		} else {
+			self->drift = false;
+		}
+	}
 
-			midi_panic (self);
-			reset_note_tracker (self);
+	if (self->clk_port >= 0 && *self->p_panic <= 0) {
+		/* 24 PPQN, div is in quarter-notes per step */
+		const double spt = sps / (24.0 * self->div);
+		if (synced) {
+			clock_process (self, n_samples, 24.0 * beats, spt, locate, true);
+		} else {
+			const double pos = 24.0 * self->div * fmod (stme, loop_duration) / sps;
+			clock_process (self, n_samples, pos, spt, locate, false);
 		}
 	}
+	self->clk_sync = synced;
 
 	double next_step = calc_next_step (self);
 	uint32_t remain = n_samples;
 
-	if (*self->p_panic > 0) {
+	const bool panic = *self->p_panic > 0;
+	if (panic) {
 		/* skip processing */
 		remain = 0;
 	}
 
-	while (stme + remain > next_step) {
+	/* Steps up to one sample after the end of the cycle are processed now.
+	 * A re-trigger note-off precedes the step by one sample, events at
+	 * `n_samples` are queued for the next cycle.
+	 */
+	while (!panic && stme + remain + 1 > next_step) {
 		uint32_t pos;
 		if (stme > next_step) {
 			/* When decreasing swing, it may be too late for an event.
@@ -596,7 +1867,10 @@ run (LV2_Handle instance, uint32_t n_samples)
 			 * In the previous cycle with a larger swing-offset, the event was
 			 * still in the future. Now with smaller swing-offset it's in the past.
 			 */
-			lv2_log_error (&self->logger, "StepSeq.lv2: Past event sneaked through.\n");
+			if (!preroll) {
+				lv2_log_error (&self->logger, "StepSeq.lv2: Past event sneaked through.\n");
+				COUNT (PORT_PAST_EVENTS);
+			}
 			pos = 0;
 		} else {
 			pos = next_step - stme;
@@ -605,48 +1879,140 @@ run (LV2_Handle instance, uint32_t n_samples)
 		remain -= pos;
 		stme += pos;
 
+		/* compensate for the rounding of sps, see update_sps() */
+		self->stme_err += self->sps_err;
+		const double adj = snap_time (self->stme_err);
+		self->stme_err -= adj;
+		stme -= adj;
+
 		self->step = (self->step + 1) % N_STEPS;
 
-			if (self->step == 0) {
-				stme -= loop_duration;
-			}
-			beat_machine (self, pos, self->step);
+		if (self->step == 0) {
+			stme -= loop_duration;
+		}
+		beat_machine (self, n_samples - remain, self->step);
 
-			next_step = calc_next_step (self);
+		next_step = calc_next_step (self);
 	}
 
 	self->stme = stme + remain;
 	self->rolling = true;
 
-	/* crude sort Atom sequence by event-time
-	 * (in drum-mode or with re-trigger events may
-	 * not be sequential in time)
-	 */
-	LV2_ATOM_SEQUENCE_FOREACH (self->midiout, ev1) {
-		LV2_ATOM_SEQUENCE_FOREACH (self->midiout, ev2) {
-			if (ev2 <= ev1) {
-				continue;
-			}
-			if (ev1->time.frames > ev2->time.frames) {
-				// swap events
-				assert (ev1->body.size == ev2->body.size);
-				assert (ev1->body.size == 3);
-				int64_t tme = ev1->time.frames;
-				uint8_t body[3];
-				memcpy (body, (const uint8_t*)(ev1 + 1), 3);
-				memcpy ((uint8_t*)(ev1 + 1), (const uint8_t*)(ev2 + 1), 3);
-				ev1->time.frames = ev2->time.frames;
-				memcpy ((uint8_t*)(ev2 + 1), body, 3);
-				ev2->time.frames = tme;
-			}
-		}
-	}
+	flush_events (self, n_samples);
+	report_counters (self);
 
-	*self->p_step = 1 + (self->step % N_STEPS);
+	if (!freewheel) {
+		*self->p_step = 1 + (self->step % N_STEPS);
+	}
+	*self->p_seeks = self->seeks;
 	if (self->host_info) {
 		/* keep track of host position.. */
-		self->bar_beats += n_samples * self->host_bpm * self->host_speed / (60.0 * self->sample_rate);
+		advance_host_position (self, n_samples);
+	}
+}
+
+#ifdef INSTRUMENT
+/* *****************************************************************************
+ * Cycle cost instrumentation
+ */
+
+static uint32_t
+stats_bin (uint64_t ns)
+{
+	if (ns < 64) {
+		return 0;
+	}
+	int e;
+	const double m = frexp (ns, &e); // ns = m * 2^e, 0.5 <= m < 1, e >= 7
+	const uint32_t b = 1 + 4 * (e - 7) + (uint32_t)((m - .5) * 8);
+	return b < STATS_BINS ? b : STATS_BINS - 1;
+}
+
+/** upper bound of a histogram bin, in usec */
+static float
+stats_bin_usec (uint32_t b)
+{
+	if (b == 0) {
+		return 0.064f;
 	}
+	return ldexp (.5 + ((b - 1) % 4 + 1) / 8.0, 7 + (b - 1) / 4) * 1e-3;
+}
+
+static float
+stats_percentile (const StepSeqStats* st, double pct)
+{
+	const uint32_t rank = ceil (st->n_cycles * pct);
+	uint32_t n = 0;
+	for (uint32_t b = 0; b < STATS_BINS; ++b) {
+		n += st->hist[b];
+		if (n >= rank) {
+			return stats_bin_usec (b);
+		}
+	}
+	return stats_bin_usec (STATS_BINS - 1);
+}
+
+static void
+stats_cycle (StepSeq* self, uint32_t n_samples, uint64_t ns)
+{
+	StepSeqStats* st = &self->stats;
+
+	++st->hist[stats_bin (ns)];
+	++st->n_cycles;
+	st->n_samples += n_samples;
+	if (ns > st->max_ns) {
+		st->max_ns = ns;
+	}
+	if (st->n_out > st->max_events) {
+		st->max_events = st->n_out;
+	}
+	st->n_out = 0;
+
+	if (st->n_samples >= self->sample_rate) {
+		st->p50    = stats_percentile (st, .50);
+		st->p99    = stats_percentile (st, .99);
+		st->max    = st->max_ns * 1e-3;
+		st->events = st->max_events;
+		memset (st->hist, 0, sizeof (st->hist));
+		st->n_cycles   = 0;
+		st->n_samples  = 0;
+		st->max_ns     = 0;
+		st->max_events = 0;
+	}
+
+	*self->p_cycle_p50  = st->p50;
+	*self->p_cycle_p99  = st->p99;
+	*self->p_cycle_max  = st->max;
+	*self->p_events_max = st->events;
+}
+#endif
+
+static void
+run (LV2_Handle instance, uint32_t n_samples)
+{
+	StepSeq* self = (StepSeq*)instance;
+#if defined INSTRUMENT || defined TRACE
+	const uint64_t t0 = monotonic_ns ();
+#endif
+#ifdef TRACE
+	self->trace.frame = self->sample_count;
+#endif
+
+	process (self, n_samples);
+
+#if defined INSTRUMENT || defined TRACE
+	const uint64_t t1 = monotonic_ns ();
+#endif
+#ifdef TRACE
+	trace_push (self, TRACE_RUN, n_samples, t0, t1 - t0);
+	++self->trace.cycle;
+#endif
+#ifdef INSTRUMENT
+	/* the cost of an offline export's cycles says nothing about realtime */
+	if (!(*self->p_freewheel > 0)) {
+		stats_cycle (self, n_samples, t1 - t0);
+	}
+#endif
 }
 
 static void
@@ -654,6 +2020,12 @@ activate (LV2_Handle instance)
 {
 	StepSeq* self = (StepSeq*)instance;
 	self->chn = 255; // queue reset/panic
+	self->clk_port = -1;
+	self->clk_rolling = false;
+	self->seeks = 0;
+	memset (self->counters, 0, sizeof (self->counters));
+	self->n_events = 0;
+	self->n_carried = 0;
 	self->step = N_STEPS - 1;
 	self->stme = N_STEPS * self->sps;
 }
@@ -661,12 +2033,213 @@ activate (LV2_Handle instance)
 static void
 cleanup (LV2_Handle instance)
 {
-	free (instance);
+	stepseq_free ((StepSeq*)instance);
+}
+
+/* *****************************************************************************
+ * State
+ *
+ * The pattern is stored as a single binary blob:
+ *  - 4 bytes magic "SSeq", 1 byte version, 1 byte N_NOTES, 1 byte N_STEPS, 1 byte N_OUTS
+ *  - 1 byte flags, 1: the pattern is an imported MIDI file (since version 2)
+ *  - N_NOTES bytes: note-number, N_NOTES bytes: channel (255: global), N_NOTES bytes: output
+ *  - N_NOTES * N_STEPS bytes: velocity, row-major
+ *
+ * Patterns of a different grid-size are restored where they overlap,
+ * remaining cells are off and remaining rows use the default note and channel.
+ *
+ * An imported pattern is not reflected in the ports, which are restored by
+ * the host. It is flagged, so that the next edit still sets the complete
+ * pattern from the ports, see pattern_update ().
+ */
+
+#if N_NOTES > 255 || N_STEPS > 255
+#error "pattern state is limited to 255 notes and steps"
+#endif
+
+#define STATE_HEADER 9
+#define STATE_IMPORTED 1
+#define STATE_SIZE (STATE_HEADER + 3 * N_NOTES + N_NOTES * N_STEPS)
+
+/** default note-number of a row, same as the port's default in gridgen.sh */
+static uint8_t
+default_note (uint32_t row)
+{
+	static const int twelvetet[7] = { 11, 1, 3, 5, 6, 8, 10 };
+	const uint32_t n = row + 1;
+	return port_int (70 - 12 * (int)((n - 1) / 7) - twelvetet[n % 7], 0, 127);
+}
+
+static LV2_State_Status
+save (LV2_Handle                instance,
+      LV2_State_Store_Function  store,
+      LV2_State_Handle          handle,
+      uint32_t                  flags,
+      const LV2_Feature* const* features)
+{
+	StepSeq* self = (StepSeq*)instance;
+	const StepSeqPattern* p = &self->pattern;
+
+	uint8_t blob[STATE_SIZE];
+	uint8_t* b = blob;
+
+	memcpy (b, "SSeq", 4);
+	b[4] = STATE_VERSION;
+	b[5] = N_NOTES;
+	b[6] = N_STEPS;
+	b[7] = N_OUTS;
+	b[8] = self->imported ? STATE_IMPORTED : 0;
+	b += STATE_HEADER;
+
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		b[n]               = p->note[n];
+		b[n + N_NOTES]     = p->chn[n] < 0 ? 255 : p->chn[n];
+		b[n + 2 * N_NOTES] = p->out[n];
+	}
+	memcpy (b + 3 * N_NOTES, p->vel, N_NOTES * N_STEPS);
+
+	return store (handle, self->uris.state_pattern, blob, STATE_SIZE,
+			self->uris.atom_Chunk, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+}
+
+static LV2_State_Status
+restore (LV2_Handle                  instance,
+         LV2_State_Retrieve_Function retrieve,
+         LV2_State_Handle            handle,
+         uint32_t                    flags,
+         const LV2_Feature* const*   features)
+{
+	StepSeq* self = (StepSeq*)instance;
+	StepSeqPattern* p = &self->pattern;
+
+	size_t   size;
+	uint32_t type;
+	uint32_t valflags;
+
+	const uint8_t* b = retrieve (handle, self->uris.state_pattern, &size, &type, &valflags);
+	if (!b || type != self->uris.atom_Chunk || size < 8 || memcmp (b, "SSeq", 4)) {
+		return LV2_STATE_ERR_NO_PROPERTY;
+	}
+	if (b[4] < 1 || b[4] > STATE_VERSION) {
+		lv2_log_warning (&self->logger, "StepSeq.lv2: unsupported pattern state version %d\n", b[4]);
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+
+	/* version 1 has no flags */
+	const uint32_t header  = b[4] < 2 ? 8 : STATE_HEADER;
+	const uint32_t n_notes = b[5];
+	const uint32_t n_steps = b[6];
+	if (size < header + 3 * n_notes + n_notes * n_steps) {
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+	const bool imported = header > 8 && (b[8] & STATE_IMPORTED);
+	b += header;
+
+	/* rows and steps that are not in the saved pattern are reset */
+	for (uint32_t n = n_notes; n < N_NOTES; ++n) {
+		p->note[n] = default_note (n);
+		p->chn[n]  = -1;
+		p->out[n]  = 0;
+	}
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		for (uint32_t s = n < n_notes ? n_steps : 0; s < N_STEPS; ++s) {
+			p->vel[n * N_STEPS + s] = 0;
+		}
+	}
+
+	for (uint32_t n = 0; n < N_NOTES && n < n_notes; ++n) {
+		p->note[n] = b[n] & 0x7f;
+		p->chn[n]  = b[n + n_notes] > 15 ? -1 : b[n + n_notes];
+		p->out[n]  = b[n + 2 * n_notes] < N_OUTS ? b[n + 2 * n_notes] : 0;
+		for (uint32_t s = 0; s < N_STEPS && s < n_steps; ++s) {
+			p->vel[n * N_STEPS + s] = b[3 * n_notes + n * n_steps + s] & 0x7f;
+		}
+	}
+
+	self->imported = imported;
+	self->resync = true;
+	return LV2_STATE_SUCCESS;
+}
+
+/* *****************************************************************************
+ * Worker
+ */
+
+static LV2_Worker_Status
+work (LV2_Handle                  instance,
+      LV2_Worker_Respond_Function respond,
+      LV2_Worker_Respond_Handle   handle,
+      uint32_t                    size,
+      const void*                 data)
+{
+	StepSeq* self = (StepSeq*)instance;
+	SMFRequest req;
+
+	if (size <= offsetof (SMFRequest, path) || size > sizeof (SMFRequest)) {
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+	memcpy (&req, data, size);
+	req.path[size - offsetof (SMFRequest, path) - 1] = '\0';
+
+	FILE* f = fopen (req.path, "rb");
+	if (!f) {
+		lv2_log_error (&self->logger, "StepSeq.lv2: cannot open '%s'\n", req.path);
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+
+	fseek (f, 0, SEEK_END);
+	const long len = ftell (f);
+	fseek (f, 0, SEEK_SET);
+
+	uint8_t* buf = NULL;
+	if (len > 0 && len <= SMF_MAX_SIZE) {
+		buf = (uint8_t*)malloc (len);
+	}
+	if (!buf || fread (buf, 1, len, f) != (size_t)len) {
+		lv2_log_error (&self->logger, "StepSeq.lv2: cannot read '%s'\n", req.path);
+		free (buf);
+		fclose (f);
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+	fclose (f);
+
+	const int rv = smf_parse (buf, len, req.div, &req.pattern);
+	free (buf);
+
+	if (rv) {
+		lv2_log_error (&self->logger, "StepSeq.lv2: '%s' is not a supported MIDI file\n", req.path);
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+
+	respond (handle, sizeof (StepSeqPattern), &req.pattern);
+	return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status
+work_response (LV2_Handle instance, uint32_t size, const void* data)
+{
+	StepSeq* self = (StepSeq*)instance;
+	if (size != sizeof (StepSeqPattern)) {
+		return LV2_WORKER_ERR_UNKNOWN;
+	}
+	/* this is called in the audio thread, between run() calls */
+	memcpy (&self->pattern, data, size);
+	self->resync = true;
+	self->imported = true;
+	return LV2_WORKER_SUCCESS;
 }
 
 static const void*
 extension_data (const char* uri)
 {
+	static const LV2_State_Interface  state  = { save, restore };
+	static const LV2_Worker_Interface worker = { work, work_response, NULL };
+	if (!strcmp (uri, LV2_STATE__interface)) {
+		return &state;
+	}
+	if (!strcmp (uri, LV2_WORKER__interface)) {
+		return &worker;
+	}
 	return NULL;
 }
 
@@ -1,6 +1,29 @@
 #define xstr(s) str(s)
 #define str(s) #s
-#define SEQ_URI "http://gareus.org/oss/lv2/stepseq#s" xstr(N_STEPS) "n" xstr(N_NOTES)
+
+#ifndef N_OUTS
+#define N_OUTS 1
+#endif
+
+#if N_OUTS < 1 || N_OUTS > 4
+#error "N_OUTS must be in the range 1..4"
+#endif
+
+/* state and patch:Set properties, independent of the grid size */
+#define STATE_URI "http://gareus.org/oss/lv2/stepseq"
+
+/* the instrumented variant has additional ports, and a URI of its own */
+#ifdef INSTRUMENT
+#define SEQ_URI_VARIANT "i"
+#else
+#define SEQ_URI_VARIANT ""
+#endif
+
+#if N_OUTS > 1
+#define SEQ_URI "http://gareus.org/oss/lv2/stepseq#s" xstr(N_STEPS) "n" xstr(N_NOTES) "o" xstr(N_OUTS) SEQ_URI_VARIANT
+#else
+#define SEQ_URI "http://gareus.org/oss/lv2/stepseq#s" xstr(N_STEPS) "n" xstr(N_NOTES) SEQ_URI_VARIANT
+#endif
 
 enum {
 	PORT_CTRL_IN = 0,
@@ -16,3 +39,32 @@ enum {
 	PORT_HOSTBPM,
 	PORT_NOTES
 };
+
+/* ports following the note-row and grid ports */
+enum {
+	PORT_GRID      = PORT_NOTES + N_NOTES,
+	PORT_ROWCHN    = PORT_GRID + N_NOTES * N_STEPS,
+	PORT_MIDI_OUTS = PORT_ROWCHN + N_NOTES,      // N_OUTS - 1 additional MIDI outputs
+	PORT_ROWOUT    = PORT_MIDI_OUTS + N_OUTS - 1, // per row output, only if N_OUTS > 1
+	PORT_CLOCK     = PORT_ROWOUT + (N_OUTS > 1 ? N_NOTES : 0),
+	PORT_SEEKS,
+	PORT_LOOKAHEAD,
+	PORT_LATMODE,
+	PORT_LATENCY,
+	PORT_FREEWHEEL,     // host exports faster than realtime
+	PORT_NOTES_ON,      // event counters, output ports
+	PORT_NOTES_OFF,
+	PORT_RETRIGGERS,
+	PORT_PANICS,
+	PORT_PAST_EVENTS,
+	PORT_DROPPED,
+	PORT_DEFERRED,
+	PORT_REDUNDANT_OFF,
+#ifdef INSTRUMENT
+	PORT_CYCLE_P50, // run() cost statistics, only with INSTRUMENT=yes
+	PORT_CYCLE_P99,
+	PORT_CYCLE_MAX,
+	PORT_EVENTS_MAX,
+#endif
+	PORT_LAST
+};
@@ -0,0 +1,379 @@
+/* stepseq -- run() micro-benchmark
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "host.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+enum {
+	MODE_STRAIGHT = 0,
+	MODE_SWING,
+	MODE_DRUM,
+	MODE_SYNC,
+	N_MODES
+};
+
+static const char* mode_names[N_MODES] = { "straight", "swing", "drum", "sync" };
+
+static const uint32_t blocksizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192 };
+static const float    densities[]  = { 0.f, .25f, .5f, 1.f };
+
+#define N_BLOCKSIZES (sizeof (blocksizes) / sizeof (blocksizes[0]))
+#define N_DENSITIES  (sizeof (densities) / sizeof (densities[0]))
+
+typedef struct {
+	uint64_t cycles;
+	uint64_t events;
+	double   total_ns;
+	double   max_ns;
+} BenchResult;
+
+static inline double
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** cost of a clock_gettime () pair, subtracted from every cycle */
+static double
+timer_overhead (void)
+{
+	double best = 1e9;
+	for (int i = 0; i < 1000; ++i) {
+		const double t0 = now_ns ();
+		const double t1 = now_ns ();
+		if (t1 - t0 < best) {
+			best = t1 - t0;
+		}
+	}
+	return best;
+}
+
+static void
+count_event (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size)
+{
+	++*(uint64_t*)arg;
+}
+
+/** fill a `density` fraction of the grid, deterministic for a given density and seed */
+static void
+set_pattern (StepSeqHost* h, float density, uint32_t seed)
+{
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		for (uint32_t s = 0; s < N_STEPS; ++s) {
+			seed = seed * 1103515245 + 12345;
+			const float r = ((seed >> 8) & 0xffff) / 65536.f;
+			host_set_cell (h, n, s, r < density ? 1 + (seed >> 4) % 127 : 0);
+		}
+	}
+}
+
+static int
+bench (BenchResult* r, double rate, uint32_t blocksize, float density, int mode, double seconds, double overhead)
+{
+	static StepSeqHost host;
+	StepSeqHost* h = &host;
+
+	if (host_init (h, rate)) {
+		return -1;
+	}
+
+	h->ports[PORT_DIVIDER] = 1; // 1/16 note
+	h->ports[PORT_SWING]   = mode == MODE_SWING ? .33f : 0.f;
+	h->ports[PORT_DRUM]    = mode == MODE_DRUM ? 1.f : 0.f;
+	if (mode == MODE_SYNC) {
+		host_set_transport (h, 120, 4, 4);
+	}
+	set_pattern (h, density, 12345);
+
+	/* warm up and apply the pattern. When free-running, the first step
+	 * is played after one loop (N_STEPS 1/16 notes at 120 BPM) */
+	uint64_t events = 0;
+	const uint64_t n_warmup = ceil ((1 + N_STEPS / 8.0) * rate / blocksize);
+	for (uint64_t i = 0; i < n_warmup; ++i) {
+		host_run (h, blocksize, NULL, NULL);
+	}
+
+	memset (r, 0, sizeof (BenchResult));
+	const uint64_t n_cycles = ceil (seconds * rate / blocksize);
+
+	for (uint64_t i = 0; i < n_cycles; ++i) {
+		host_cycle_begin (h, blocksize);
+		const double t0 = now_ns ();
+		h->desc->run (h->instance, blocksize);
+		const double t1 = now_ns ();
+		host_cycle_end (h, blocksize, count_event, &events);
+
+		const double dt = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+		r->total_ns += dt;
+		if (dt > r->max_ns) {
+			r->max_ns = dt;
+		}
+	}
+
+	r->cycles = n_cycles;
+	r->events = events;
+
+	host_cleanup (h);
+	return 0;
+}
+
+/**
+ * run `n` instances with different patterns and settings round-robin,
+ * like a host processing a session: every cycle all instances are run
+ * back to back. `r->total_ns` is the time for all instances.
+ */
+static int
+bench_instances (BenchResult* r, double rate, uint32_t blocksize, uint32_t n, double seconds, double overhead)
+{
+	StepSeqHost* hosts = (StepSeqHost*)calloc (n, sizeof (StepSeqHost));
+	if (!hosts) {
+		return -1;
+	}
+
+	uint32_t n_init = 0;
+	for (; n_init < n; ++n_init) {
+		StepSeqHost* h = &hosts[n_init];
+		const uint32_t k = n_init;
+		if (host_init (h, rate)) {
+			break;
+		}
+		h->ports[PORT_DIVIDER] = k % 3;
+		h->ports[PORT_SWING]   = k % 4 == 1 ? .33f : 0.f;
+		h->ports[PORT_DRUM]    = k % 5 == 2 ? 1.f : 0.f;
+		h->ports[PORT_BPM]     = 90 + k % 60;
+		if (k % 2) {
+			host_set_transport (h, 120, 4, 4);
+		}
+		set_pattern (h, densities[1 + k % (N_DENSITIES - 1)], 12345 + k);
+	}
+
+	uint64_t events = 0;
+	if (n_init == n) {
+		const uint64_t n_warmup = ceil ((1 + N_STEPS / 4.0) * rate / blocksize);
+		for (uint64_t i = 0; i < n_warmup; ++i) {
+			for (uint32_t k = 0; k < n; ++k) {
+				host_run (&hosts[k], blocksize, NULL, NULL);
+			}
+		}
+
+		memset (r, 0, sizeof (BenchResult));
+		const uint64_t n_cycles = ceil (seconds * rate / blocksize);
+
+		for (uint64_t i = 0; i < n_cycles; ++i) {
+			for (uint32_t k = 0; k < n; ++k) {
+				host_cycle_begin (&hosts[k], blocksize);
+			}
+			const double t0 = now_ns ();
+			for (uint32_t k = 0; k < n; ++k) {
+				hosts[k].desc->run (hosts[k].instance, blocksize);
+			}
+			const double t1 = now_ns ();
+			for (uint32_t k = 0; k < n; ++k) {
+				host_cycle_end (&hosts[k], blocksize, count_event, &events);
+			}
+
+			const double dt = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+			r->total_ns += dt;
+			if (dt > r->max_ns) {
+				r->max_ns = dt;
+			}
+		}
+		r->cycles = n_cycles;
+		r->events = events;
+	}
+
+	for (uint32_t k = 0; k < n_init; ++k) {
+		host_cleanup (&hosts[k]);
+	}
+	free (hosts);
+	return n_init == n ? 0 : -1;
+}
+
+static void
+usage (int status)
+{
+	printf ("stepseq-bench - Measure the cost of the step sequencer's run().\n\n"
+	        "Usage: stepseq-bench [ OPTIONS ]\n\n"
+	        "Options:\n"
+	        "  -B, --blocksize <num>    samples per cycle with --instances (default 64)\n"
+	        "  -d, --duration <sec>     audio duration per measurement (default 10)\n"
+	        "  -h, --help               display this help and exit\n"
+	        "  -H, --no-header          do not print the CSV header\n"
+	        "  -i, --instances <list>   run this many instances, comma separated counts,\n"
+	        "                           e.g. 1,16,128,1024\n"
+	        "  -j, --json               print JSON lines instead of CSV\n"
+#ifdef HOST_DLOPEN
+	        "  -P, --plugin <file>      plugin shared object to measure (required)\n"
+#endif
+	        "  -r, --rate <num>         sample rate (default 48000)\n"
+	        "\n"
+	        "Block sizes 16..8192, pattern densities 0..100%% and straight, swing,\n"
+	        "drum-mode and host-synced playback (1/16 notes at 120 BPM) are measured\n"
+	        "for the compile-time grid size (%dx%d, %d output%s).\n"
+	        "Times are wall-clock nanoseconds spent in run().\n"
+	        "\n"
+	        "With --instances, instances with different patterns, tempi and modes are\n"
+	        "run round-robin, like a host processing a session, and the cost per\n"
+	        "instance is reported for every instance count.\n",
+	        N_STEPS, N_NOTES, N_OUTS, N_OUTS > 1 ? "s" : "");
+	exit (status);
+}
+
+static const struct option long_options[] = {
+	{ "blocksize", required_argument, 0, 'B' },
+	{ "duration",  required_argument, 0, 'd' },
+	{ "help",      no_argument,       0, 'h' },
+	{ "no-header", no_argument,       0, 'H' },
+	{ "instances", required_argument, 0, 'i' },
+	{ "json",      no_argument,       0, 'j' },
+#ifdef HOST_DLOPEN
+	{ "plugin",    required_argument, 0, 'P' },
+#endif
+	{ "rate",      required_argument, 0, 'r' },
+	{ 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	double seconds = 10;
+	double rate    = 48000;
+	bool   header  = true;
+	bool   json    = false;
+	char*  counts  = NULL;
+
+	uint32_t blocksize = 64;
+#ifdef HOST_DLOPEN
+	const char* plugin = NULL;
+#endif
+
+	int c;
+	while ((c = getopt_long (argc, argv, "B:d:hHi:jP:r:", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'B':
+				blocksize = atoi (optarg);
+				break;
+			case 'd':
+				seconds = atof (optarg);
+				break;
+			case 'h':
+				usage (0);
+				break;
+			case 'H':
+				header = false;
+				break;
+			case 'i':
+				counts = optarg;
+				break;
+			case 'j':
+				json = true;
+				break;
+#ifdef HOST_DLOPEN
+			case 'P':
+				plugin = optarg;
+				break;
+#endif
+			case 'r':
+				rate = atof (optarg);
+				break;
+			default:
+				usage (1);
+				break;
+		}
+	}
+
+	if (optind != argc || seconds <= 0 || rate < 8000 || blocksize < 1 || blocksize > 8192) {
+		usage (1);
+	}
+
+#ifdef HOST_DLOPEN
+	if (!plugin) {
+		usage (1);
+	}
+	if (host_open (plugin)) {
+		return 1;
+	}
+#endif
+
+	const double overhead = timer_overhead ();
+
+	if (counts) {
+		if (header && !json) {
+			printf ("grid,notes,steps,outs,instances,blocksize,cycles,events,ns_per_cycle,ns_per_instance,max_cycle_ns\n");
+		}
+		for (char* tok = strtok (counts, ","); tok; tok = strtok (NULL, ",")) {
+			const int n = atoi (tok);
+			BenchResult r;
+			if (n < 1 || bench_instances (&r, rate, blocksize, n, seconds, overhead)) {
+				fprintf (stderr, "Cannot instantiate %d plugin instance(s)\n", n);
+				return 1;
+			}
+			const double ns_cycle = r.total_ns / r.cycles;
+			if (json) {
+				printf ("{\"grid\":\"%dx%d\",\"notes\":%d,\"steps\":%d,\"outs\":%d,\"instances\":%d,\"blocksize\":%u,"
+				        "\"cycles\":%" PRIu64 ",\"events\":%" PRIu64 ",\"ns_per_cycle\":%.1f,"
+				        "\"ns_per_instance\":%.1f,\"max_cycle_ns\":%.0f}\n",
+				        N_STEPS, N_NOTES, N_NOTES, N_STEPS, N_OUTS, n, blocksize,
+				        r.cycles, r.events, ns_cycle, ns_cycle / n, r.max_ns);
+			} else {
+				printf ("%dx%d,%d,%d,%d,%d,%u,%" PRIu64 ",%" PRIu64 ",%.1f,%.1f,%.0f\n",
+				        N_STEPS, N_NOTES, N_NOTES, N_STEPS, N_OUTS, n, blocksize,
+				        r.cycles, r.events, ns_cycle, ns_cycle / n, r.max_ns);
+			}
+			fflush (stdout);
+		}
+		return 0;
+	}
+
+	if (header && !json) {
+		printf ("grid,notes,steps,outs,blocksize,density,mode,cycles,events,ns_per_cycle,ns_per_event,max_cycle_ns,events_per_sec\n");
+	}
+
+	for (int m = 0; m < N_MODES; ++m) {
+		for (uint32_t d = 0; d < N_DENSITIES; ++d) {
+			for (uint32_t b = 0; b < N_BLOCKSIZES; ++b) {
+				BenchResult r;
+				if (bench (&r, rate, blocksizes[b], densities[d], m, seconds, overhead)) {
+					fprintf (stderr, "Cannot instantiate plugin\n");
+					return 1;
+				}
+				const double ns_cycle = r.total_ns / r.cycles;
+				const double ns_event = r.events > 0 ? r.total_ns / r.events : 0;
+				const double ev_sec   = r.total_ns > 0 ? r.events * 1e9 / r.total_ns : 0;
+				if (json) {
+					printf ("{\"grid\":\"%dx%d\",\"notes\":%d,\"steps\":%d,\"outs\":%d,\"blocksize\":%u,\"density\":%.2f,"
+					        "\"mode\":\"%s\",\"cycles\":%" PRIu64 ",\"events\":%" PRIu64 ",\"ns_per_cycle\":%.1f,"
+					        "\"ns_per_event\":%.1f,\"max_cycle_ns\":%.0f,\"events_per_sec\":%.0f}\n",
+					        N_STEPS, N_NOTES, N_NOTES, N_STEPS, N_OUTS, blocksizes[b], densities[d],
+					        mode_names[m], r.cycles, r.events, ns_cycle, ns_event, r.max_ns, ev_sec);
+				} else {
+					printf ("%dx%d,%d,%d,%d,%u,%.2f,%s,%" PRIu64 ",%" PRIu64 ",%.1f,%.1f,%.0f,%.0f\n",
+					        N_STEPS, N_NOTES, N_NOTES, N_STEPS, N_OUTS, blocksizes[b], densities[d],
+					        mode_names[m], r.cycles, r.events, ns_cycle, ns_event, r.max_ns, ev_sec);
+				}
+				fflush (stdout);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,876 @@
+/* stepseq -- golden-output regression tests
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every scenario is rendered through run () and the emitted events are
+ * written as text, one line per event:
+ *
+ *   <sample-time> <port> <hex bytes>
+ *
+ * Log messages are included as "<sample-time> # <message>".
+ * The result is compared line by line to tools/golden/<scenario>.txt
+ *
+ * With --timing, every scenario is also rendered with different block
+ * sizes, and random mixes of block sizes. Event times must not depend on
+ * how time is split into cycles, the output has to be identical. The mixes
+ * are also rendered freewheeling (export faster than realtime), except for
+ * the last cycle, which reports the current step.
+ * A "Past event" may only be logged in a cycle where swing is decreased.
+ *
+ * MIDI files to import are read from tools/fixtures/.
+ */
+
+#include "host.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+
+#if N_NOTES != 8 || N_STEPS != 8 || N_OUTS != 1
+# error "golden files are for an 8x8 grid with one output"
+#endif
+
+#define RATE 48000
+
+/* transport actions, in place of a port-index */
+enum {
+	ACT_END    = -1,
+	ACT_LOCATE = -2, // host position in beats
+	ACT_TEMPO  = -3, // host or MIDI clock BPM
+	ACT_ROLL   = -4, // host transport 0: stopped, 1: rolling; MIDI clock 0: stop
+	ACT_JITTER = -5, // MIDI clock jitter, +/- samples
+	ACT_DROP   = -6, // drop the next N MIDI clock ticks
+	ACT_UNPLUG = -7, // MIDI clock ceases without a stop message
+	ACT_POS_JITTER = -8, // host position jitter, +/- ticks (SEEK_PPQN)
+	ACT_SAVE   = -9,  // save the state
+	ACT_RESTORE = -10, // 0: restore the saved state, else a foreign one, see foreign_state ()
+	ACT_IMPORT = -11, // import tools/fixtures/import.mid
+};
+
+/* MIDI clock slave lock, see check_mclk () */
+#define MCLK_SEED      1
+#define MCLK_TICKS     12   // ticks per step, for a 1/8 note division
+#define MCLK_SETTLE    1.5   // seconds after start, tempo change and dropout that are not checked
+#define MCLK_STEP_ERR  4    // max. deviation of a step from its tick in samples, plus half the jitter
+#define MCLK_BPM_ERR   0.1  // max. deviation of the tempo
+#define MCLK_MAX_STEPS 1024
+
+enum {
+	SYNC_NONE = 0,
+	SYNC_HOST,
+	SYNC_MCLK,
+};
+
+typedef struct {
+	double at;    // time in seconds
+	int    port;  // control port or ACT_*
+	float  value;
+} Action;
+
+typedef struct {
+	const char*   name;
+	const char*   desc;
+	int           sync;
+	double        bpm;
+	int           bpb;
+	int           unit;
+	double        duration;  // seconds
+	const Action* actions;   // in chronological order, terminated by ACT_END
+	uint32_t      tolerance; // max. deviation of event-times across block sizes
+} Scenario;
+
+#define CELL(row, step) (PORT_GRID + (row) * N_STEPS + (step))
+
+static const Action a_free[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_free_tempo[] = {
+	{ 0,    PORT_DIVIDER, 2 },
+	{ 1.37, PORT_BPM, 97 },
+	{ 2.61, PORT_BPM, 180 },
+	{ 3.1,  PORT_DIVIDER, 1 },
+	{ 4.3,  PORT_DIVIDER, 4 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_swing[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   PORT_SWING, .33 },
+	{ 38000.0 / RATE, PORT_SWING, .1 }, // too late for step 4 (36000 + 3960): past event
+	{ 2.2, PORT_SWING, .33 },
+	{ 2.3, PORT_SWING, .2 },
+	{ 3.5, PORT_SWING, .5 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_drum[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, PORT_DRUM, 1 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_edit[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.1, CELL (0, 3), 80 },
+	{ 1.6, PORT_NOTES + 1, 61 },
+	{ 2.3, CELL (0, 0), 0 },
+	{ 2.9, PORT_ROWCHN + 3, 4 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_panic[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.5, PORT_PANIC, 1 },
+	{ 1.5 + 1.0 / RATE, PORT_PANIC, 0 }, // a single one sample cycle
+	{ 2.5, PORT_CHN, 5 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync_34[] = {
+	{ 0, PORT_DIVIDER, 3 },
+	{ 4, PORT_DIVIDER, 7 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync_68[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync_78[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_seek[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.8, ACT_LOCATE, 1.5 },
+	{ 3.1, ACT_LOCATE, 13.25 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync_jitter[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_POS_JITTER, 50 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_sync_tempo[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.3, ACT_TEMPO, 90 },
+	{ 2.9, ACT_TEMPO, 140 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_stop[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.7, ACT_ROLL, 0 },
+	{ 2.4, ACT_ROLL, 1 },
+	{ 3.0, ACT_LOCATE, 0 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_clock_free[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   PORT_CLOCK, 1 },
+	{ 1.2, PORT_BPM, 140 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_clock_sync[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   PORT_CLOCK, 1 },
+	{ 1.0, ACT_LOCATE, 6.25 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 2, ACT_TEMPO, 132 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk_jitter[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   ACT_JITTER, 48 },
+	{ 2.5, ACT_TEMPO, 132 },
+	{ 5,   ACT_TEMPO, 96 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk_stop[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 2.1, ACT_ROLL, 0 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk_lost[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.95, ACT_UNPLUG, 0 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk_none[] = {
+	{ 0, PORT_DIVIDER, 2 },
+	{ 0, ACT_UNPLUG, 0 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_mclk_dropout[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   ACT_JITTER, 48 },
+	{ 2.1, ACT_DROP, 1 },
+	{ 4.1, ACT_DROP, 7 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_state[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0.6, ACT_SAVE, 0 },
+	{ 1.1, CELL (0, 2), 100 },
+	{ 1.1, CELL (4, 0), 0 },
+	{ 1.1, PORT_NOTES + 2, 50 },
+	{ 2.1, ACT_RESTORE, 0 },
+	{ 3.1, ACT_RESTORE, 1 },
+	{ 4.1, ACT_RESTORE, 2 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_import[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 1.27, ACT_IMPORT, 0 }, // rows 0-2 are silent until the next step, the worker responds before it
+	{ 1.6,  ACT_SAVE, 0 },
+	{ 2.1,  ACT_RESTORE, 0 }, // session reload, the ports are not changed by the import
+	{ 2.6,  CELL (1, 3), 30 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Action a_lookahead[] = {
+	{ 0,   PORT_DIVIDER, 2 },
+	{ 0,   PORT_LOOKAHEAD, 480 },
+	{ 0,   PORT_LATMODE, 1 },
+	{ 2.1, ACT_LOCATE, 4.95 },
+	{ 0, ACT_END, 0 }
+};
+
+static const Scenario scenarios[] = {
+	{ "free",        "free-running, 1/8 notes",                  SYNC_NONE, 120, 4, 4, 4, a_free, 0 },
+	{ "free-tempo",  "free-running, BPM and division changes",   SYNC_NONE, 120, 4, 4, 6, a_free_tempo, 0 },
+	{ "swing",       "swing, including a swing decrease",        SYNC_NONE, 120, 4, 4, 5, a_swing, 0 },
+	{ "drum",        "drum-mode retriggers",                     SYNC_NONE, 120, 4, 4, 4, a_drum, 0 },
+	{ "edit",        "grid, note and channel edits mid-loop",    SYNC_NONE, 120, 4, 4, 4, a_edit, 0 },
+	{ "panic",       "panic button and channel change",          SYNC_NONE, 120, 4, 4, 4, a_panic, 0 },
+	{ "sync",        "host-synced 4/4",                          SYNC_HOST, 120, 4, 4, 4, a_sync, 0 },
+	{ "sync-34",     "host-synced 3/4, quarter and 2-bar steps", SYNC_HOST, 100, 3, 4, 8, a_sync_34, 0 },
+	{ "sync-68",     "host-synced 6/8",                          SYNC_HOST, 150, 6, 8, 4, a_sync_68, 0 },
+	{ "sync-78",     "host-synced 7/8, pattern wraps mid-bar",   SYNC_HOST, 140, 7, 8, 5, a_sync_78, 0 },
+	{ "sync-seek",   "host seeks backwards and forward",         SYNC_HOST, 120, 4, 4, 5, a_seek, 0 },
+	{ "sync-jitter", "host position jitter, near seek tolerance", SYNC_HOST, 120, 4, 4, 4.9, a_sync_jitter, 1024 }, // cycles see different jitter
+	{ "sync-tempo",  "host tempo changes",                       SYNC_HOST, 120, 4, 4, 5, a_sync_tempo, 0 },
+	{ "sync-stop",   "host transport stop, start and locate",    SYNC_HOST, 120, 4, 4, 4.5, a_stop, 0 },
+	{ "clock-free",  "MIDI clock output, free-running",          SYNC_NONE, 120, 4, 4, 2, a_clock_free, 0 },
+	{ "clock-sync",  "MIDI clock output, host-synced with seek", SYNC_HOST, 120, 4, 4, 2, a_clock_sync, 0 },
+	{ "mclk",        "slave to MIDI clock input",                SYNC_MCLK, 120, 4, 4, 5, a_mclk, 128 }, // clock input is evaluated per cycle
+	{ "mclk-jitter", "MIDI clock with jitter and tempo jumps",   SYNC_MCLK, 120, 4, 4, 7, a_mclk_jitter, 128 },
+	{ "mclk-dropout", "MIDI clock with jitter and lost ticks",   SYNC_MCLK, 120, 4, 4, 5.95, a_mclk_dropout, 128 },
+	{ "mclk-stop",   "MIDI clock stop, followed by no ticks",    SYNC_MCLK, 120, 4, 4, 5, a_mclk_stop, 128 },
+	{ "mclk-lost",   "MIDI clock ceases while running",          SYNC_MCLK, 120, 4, 4, 5, a_mclk_lost, 8192 }, // detected once per cycle
+	{ "mclk-none",   "MIDI clock sync without a clock",          SYNC_MCLK, 120, 4, 4, 4, a_mclk_none, 0 },
+	{ "state",       "state save, edit, restore, foreign grid sizes", SYNC_NONE, 120, 4, 4, 5, a_state, 0 },
+	{ "import",      "MIDI file import, save, restore and edit", SYNC_NONE, 120, 4, 4, 4, a_import, 0 },
+	{ "lookahead",   "host-synced with look-ahead",              SYNC_HOST, 120, 4, 4, 3, a_lookahead, 0 },
+};
+
+#define N_SCENARIOS (sizeof (scenarios) / sizeof (scenarios[0]))
+
+/** test pattern, same for all scenarios */
+static void
+set_pattern (StepSeqHost* h)
+{
+	static const int grid[N_NOTES][N_STEPS] = {
+		{ 100,   0,   0,   0, 100,   0,   0,   0 }, // quarter notes
+		{   0,   0,  90,   0,   0,   0,  90,   0 }, // off-beat
+		{  70,  70,  70,  70,   0,   0,   0,   0 }, // legato
+		{   0,  50,   0,  60,   0,  70,   0,  80 }, // odd steps
+		{ 110, 110, 110, 110, 110, 110, 110, 110 }, // always on
+		{   0,   0,   0,   0,   0,   0,   0, 127 }, // last step
+		{   0,   0,   0,   0,   0,   0,   0,   0 }, // unused
+		{  64,   0,   0,   0,   0,  64,   0,   0 }, // custom channel
+	};
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		for (uint32_t s = 0; s < N_STEPS; ++s) {
+			host_set_cell (h, n, s, grid[n][s]);
+		}
+	}
+	h->ports[PORT_ROWCHN + 7] = 9;
+}
+
+/**
+ * state of a plugin built for a different grid, 1: 4 rows x 16 steps with
+ * two outputs, saved by version 1 without flags, 2: 12 rows x 4 steps.
+ * Every row uses a different note.
+ */
+static size_t
+foreign_state (int which, uint8_t* blob)
+{
+	const uint32_t n_notes = which == 1 ? 4 : 12;
+	const uint32_t n_steps = which == 1 ? 16 : 4;
+	const uint32_t n_outs  = which == 1 ? 2 : 1;
+
+	const uint32_t header  = which == 1 ? 8 : STATE_HEADER;
+
+	memcpy (blob, "SSeq", 4);
+	blob[4] = which == 1 ? 1 : STATE_VERSION;
+	blob[5] = n_notes;
+	blob[6] = n_steps;
+	blob[7] = n_outs;
+	blob[8] = 0;
+
+	uint8_t* b = blob + header;
+	for (uint32_t n = 0; n < n_notes; ++n) {
+		b[n]               = 36 + n;
+		b[n + n_notes]     = n == 1 ? 3 : 255;
+		b[n + 2 * n_notes] = n % n_outs;
+		for (uint32_t s = 0; s < n_steps; ++s) {
+			b[3 * n_notes + n * n_steps + s] = (s + n) % 3 ? 0 : 40 + 5 * n + s;
+		}
+	}
+	return header + 3 * n_notes + n_notes * n_steps;
+}
+
+static const char* fixture_dir = "tools/fixtures";
+
+typedef struct {
+	FILE* out;
+	bool  swing_decreased; // in the current cycle
+	int   unexpected;      // past events without swing decrease
+
+	/* MIDI clock slave: the time of every step's tick (without jitter), the
+	 * time of note-ons, and of changes after which the slave has to settle */
+	bool     mclk;
+	double   step_tick[MCLK_MAX_STEPS];
+	uint32_t n_steps;
+	int64_t  note_on[MCLK_MAX_STEPS];
+	uint32_t n_note_on;
+	int64_t  change[16];
+	uint32_t n_changes;
+	double   step_err;
+	double   bpm_err;     // max. deviation of the tempo, when settled
+	double   clock_end;   // time the master's clock ceased
+	double   clock_grace; // the slave may play until clock_end + clock_grace
+} CheckCtx;
+
+/** MIDI clock lock is not checked at the start, and after a tempo change or dropout */
+static bool
+mclk_settled (const CheckCtx* ctx, double t)
+{
+	for (uint32_t i = 0; i < ctx->n_changes; ++i) {
+		if (t >= ctx->change[i] - ctx->step_err && t < ctx->change[i] + MCLK_SETTLE * RATE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+check_event (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size)
+{
+	CheckCtx* ctx = (CheckCtx*)arg;
+	if (ctx->mclk && size == 3 && (buf[0] & 0xf0) == 0x90 && buf[2] > 0
+	    && ctx->n_note_on < MCLK_MAX_STEPS && (ctx->n_note_on == 0 || ctx->note_on[ctx->n_note_on - 1] != frame)) {
+		ctx->note_on[ctx->n_note_on++] = frame;
+	}
+	fprintf (ctx->out, "%" PRId64 " %u", frame, port);
+	for (uint32_t i = 0; i < size; ++i) {
+		fprintf (ctx->out, " %02x", buf[i]);
+	}
+	fprintf (ctx->out, "\n");
+}
+
+static void
+check_log (void* arg, int64_t frame, const char* msg)
+{
+	CheckCtx* ctx = (CheckCtx*)arg;
+	fprintf (ctx->out, "%" PRId64 " # %s\n", frame, msg);
+	if (strstr (msg, "Past event") && !ctx->swing_decreased) {
+		++ctx->unexpected;
+	}
+}
+
+static void
+check_mclk_tick (void* arg, int64_t tick, double time)
+{
+	CheckCtx* ctx = (CheckCtx*)arg;
+	if (tick % MCLK_TICKS == 0 && ctx->n_steps < MCLK_MAX_STEPS && time < ctx->clock_end) {
+		ctx->step_tick[ctx->n_steps++] = time;
+	}
+}
+
+/**
+ * The slave has to play step k at the time of the master's tick
+ * MCLK_TICKS * k, jitter removed, and report the master's tempo.
+ * This includes steps after ticks that were lost.
+ */
+static int
+check_mclk (const Scenario* sc, const CheckCtx* ctx, int64_t n_total)
+{
+	int rv = 0;
+	if (ctx->bpm_err > MCLK_BPM_ERR) {
+		fprintf (stderr, "FAIL: %s, tempo is off by %.3f BPM\n", sc->name, ctx->bpm_err);
+		rv = -1;
+	}
+
+	/* every note-on is at a step */
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < ctx->n_note_on; ++i) {
+		const double t = ctx->note_on[i];
+		if (t >= ctx->clock_end + ctx->clock_grace) {
+			fprintf (stderr, "FAIL: %s, note-on at %.0f, after the clock ceased at %.0f\n",
+			         sc->name, t, ctx->clock_end);
+			return -1;
+		}
+		if (!mclk_settled (ctx, t) || t >= ctx->clock_end) {
+			continue;
+		}
+		while (k + 1 < ctx->n_steps && fabs (ctx->step_tick[k + 1] - t) < fabs (ctx->step_tick[k] - t)) {
+			++k;
+		}
+		if (ctx->n_steps == 0 || fabs (t - ctx->step_tick[k]) > ctx->step_err) {
+			fprintf (stderr, "FAIL: %s, note-on at %.0f, %.1f samples from the step\n",
+			         sc->name, t, ctx->n_steps > 0 ? t - ctx->step_tick[k] : 0);
+			return -1;
+		}
+	}
+
+	/* every step is played */
+	uint32_t i = 0;
+	for (k = 0; k < ctx->n_steps; ++k) {
+		const double t = ctx->step_tick[k];
+		if (!mclk_settled (ctx, t) || t + ctx->step_err >= n_total) {
+			continue;
+		}
+		while (i < ctx->n_note_on && ctx->note_on[i] < t - ctx->step_err) {
+			++i;
+		}
+		if (i == ctx->n_note_on || ctx->note_on[i] > t + ctx->step_err) {
+			fprintf (stderr, "FAIL: %s, step %u at %.0f was not played\n", sc->name, k, t);
+			return -1;
+		}
+	}
+	return rv;
+}
+
+static void
+apply_action (StepSeqHost* h, const Action* a)
+{
+	switch (a->port) {
+		case ACT_LOCATE:
+			host_locate (h, a->value);
+			break;
+		case ACT_TEMPO:
+			host_set_bpm (h, a->value);
+			break;
+		case ACT_ROLL:
+			if (h->mclk && !(a->value > 0)) {
+				host_stop_mclk (h);
+			} else {
+				h->rolling = a->value > 0;
+			}
+			break;
+		case ACT_JITTER:
+			host_set_mclk_jitter (h, a->value, MCLK_SEED);
+			break;
+		case ACT_DROP:
+			host_drop_mclk (h, a->value);
+			break;
+		case ACT_UNPLUG:
+			host_unplug_mclk (h);
+			break;
+		case ACT_POS_JITTER:
+			h->pos_jitter = a->value / SEEK_PPQN;
+			break;
+		case ACT_SAVE:
+			if (host_save_state (h)) {
+				fprintf (stderr, "Cannot save state\n");
+			}
+			break;
+		case ACT_RESTORE:
+			if (a->value > 0) {
+				uint8_t blob[STATE_HEADER + 3 * 12 + 12 * 16];
+				host_set_state (h, blob, foreign_state (a->value, blob));
+			}
+			if (host_restore_state (h)) {
+				fprintf (stderr, "Cannot restore state\n");
+			}
+			break;
+		case ACT_IMPORT:
+			{
+				char path[1024];
+				snprintf (path, sizeof (path), "%s/import.mid", fixture_dir);
+				host_load_smf (h, path);
+			}
+			break;
+		default:
+			h->ports[a->port] = a->value;
+			break;
+	}
+}
+
+/**
+ * render a scenario, cycles are split at action times.
+ * @param blocksize max. number of samples per cycle
+ * @param blocks optional list of block sizes, used in a round-robin fashion
+ * @param freewheel run all but the last cycle freewheeling
+ */
+static int
+render (const Scenario* sc, FILE* out, uint32_t blocksize, const uint32_t* blocks, uint32_t n_blocks, bool freewheel)
+{
+	static StepSeqHost host;
+	StepSeqHost*       h = &host;
+	CheckCtx           ctx;
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.out        = out;
+	ctx.mclk       = sc->sync == SYNC_MCLK;
+	ctx.n_changes  = 1; // start
+	ctx.step_err   = MCLK_STEP_ERR;
+	ctx.clock_end  = INFINITY;
+
+	if (host_init (h, RATE)) {
+		return -1;
+	}
+	h->log_cb  = check_log;
+	h->log_arg = &ctx;
+
+	set_pattern (h);
+	h->ports[PORT_BPM] = sc->bpm;
+
+	if (sc->sync == SYNC_HOST) {
+		host_set_transport (h, sc->bpm, sc->bpb, sc->unit);
+	} else if (sc->sync == SYNC_MCLK) {
+		host_set_mclk (h, sc->bpm);
+		h->mclk_cb  = check_mclk_tick;
+		h->mclk_arg = &ctx;
+	}
+
+	const int64_t n_total = llrint (sc->duration * RATE);
+	const Action* a       = sc->actions;
+	uint32_t      b       = 0;
+
+	while (h->time < n_total) {
+		ctx.swing_decreased = false;
+		while (a->port != ACT_END && llrint (a->at * RATE) <= h->time) {
+			if (a->port == PORT_SWING && a->value < h->ports[PORT_SWING]) {
+				ctx.swing_decreased = true;
+			}
+			if ((a->port == ACT_TEMPO || a->port == ACT_DROP) && ctx.n_changes < 16) {
+				ctx.change[ctx.n_changes++] = h->time;
+			}
+			if (ctx.mclk && ((a->port == ACT_ROLL && !(a->value > 0)) || a->port == ACT_UNPLUG)) {
+				/* after a stop the slave must not play, a lost clock is detected after a timeout */
+				ctx.clock_end   = h->time;
+				ctx.clock_grace = (a->port == ACT_UNPLUG && h->mclk_next > 0) ? MCLK_TIMEOUT * RATE : 0;
+			}
+			if (a->port == ACT_JITTER) {
+				ctx.step_err = MCLK_STEP_ERR + a->value / 2;
+			}
+			apply_action (h, a++);
+		}
+		int64_t n = blocks ? blocks[b++ % n_blocks] : blocksize;
+		if (n > n_total - h->time) {
+			n = n_total - h->time;
+		}
+		if (a->port != ACT_END && n > llrint (a->at * RATE) - h->time) {
+			n = llrint (a->at * RATE) - h->time;
+		}
+		h->ports[PORT_FREEWHEEL] = freewheel && h->time + n < n_total;
+		host_run (h, n, check_event, &ctx);
+
+		/* the host BPM port is not updated while freewheeling */
+		if (((ctx.mclk && mclk_settled (&ctx, h->time - n)) || sc->sync == SYNC_HOST) && !(h->ports[PORT_FREEWHEEL] > 0)) {
+			ctx.bpm_err = fmax (ctx.bpm_err, fabs (h->ports[PORT_HOSTBPM] - h->bpm));
+		}
+	}
+
+	fprintf (out, "%" PRId64 " # step %d seeks %d\n", h->time, (int)h->ports[PORT_STEP], (int)h->ports[PORT_SEEKS]);
+
+	host_cleanup (h);
+
+#ifdef RT_AUDIT
+	if (rt_audit_report (sc->name) > 0) {
+		return -1;
+	}
+#endif
+
+	if (ctx.mclk && check_mclk (sc, &ctx, n_total)) {
+		return -1;
+	}
+
+	/* the host's tempo is reported in its own beat-unit */
+	if (sc->sync == SYNC_HOST && ctx.bpm_err > 0.001) {
+		fprintf (stderr, "FAIL: %s, host BPM is reported off by %.3f\n", sc->name, ctx.bpm_err);
+		return -1;
+	}
+
+	if (ctx.unexpected > 0) {
+		fprintf (stderr, "FAIL: %s, %d past event%s without swing decrease\n",
+		         sc->name, ctx.unexpected, ctx.unexpected > 1 ? "s" : "");
+		return -1;
+	}
+	return 0;
+}
+
+/** split "<time> <rest>" */
+static const char*
+parse_line (const char* line, int64_t* time)
+{
+	char* rest;
+	*time = strtoll (line, &rest, 10);
+	return rest;
+}
+
+/**
+ * compare two files line by line, report the first difference.
+ * Event times may differ by up to `tolerance` samples.
+ */
+static int
+compare (const char* name, const char* label, FILE* a, FILE* b, uint32_t tolerance)
+{
+	char la[256];
+	char lb[256];
+	for (int line = 1;; ++line) {
+		const char* ra = fgets (la, sizeof (la), a);
+		const char* rb = fgets (lb, sizeof (lb), b);
+		if (!ra && !rb) {
+			return 0;
+		}
+		bool same = ra && rb;
+		if (same && tolerance > 0) {
+			int64_t ta, tb;
+			const char* ea = parse_line (la, &ta);
+			const char* eb = parse_line (lb, &tb);
+			same = !strcmp (ea, eb) && llabs (ta - tb) <= tolerance;
+		} else if (same) {
+			same = !strcmp (la, lb);
+		}
+		if (!same) {
+			fprintf (stderr, "FAIL: %s%s, line %d\n", name, label, line);
+			fprintf (stderr, "  expected: %s", rb ? lb : "<EOF>\n");
+			fprintf (stderr, "  got:      %s", ra ? la : "<EOF>\n");
+			return -1;
+		}
+	}
+}
+
+/** render to a temporary file and compare to the golden file at `path` */
+static int
+test_scenario (const Scenario* sc, const char* path, const char* label,
+               uint32_t blocksize, const uint32_t* blocks, uint32_t n_blocks, bool freewheel, uint32_t tolerance)
+{
+	FILE* g = fopen (path, "r");
+	if (!g) {
+		fprintf (stderr, "FAIL: %s, cannot open '%s'\n", sc->name, path);
+		return -1;
+	}
+	FILE* t = tmpfile ();
+	if (!t || render (sc, t, blocksize, blocks, n_blocks, freewheel)) {
+		fprintf (stderr, "FAIL: %s%s, cannot render\n", sc->name, label);
+		fclose (g);
+		if (t) {
+			fclose (t);
+		}
+		return -1;
+	}
+	rewind (t);
+	const int rv = compare (sc->name, label, t, g, tolerance);
+	fclose (t);
+	fclose (g);
+	return rv;
+}
+
+/** render with various block sizes, results must match the golden file */
+static int
+test_timing (const Scenario* sc, const char* path)
+{
+	static const uint32_t blocksizes[] = { 1, 7, 64, 1000, 8192 };
+	char label[64];
+	int  rv = 0;
+
+	for (uint32_t i = 0; i < sizeof (blocksizes) / sizeof (blocksizes[0]); ++i) {
+		snprintf (label, sizeof (label), ", blocksize %u", blocksizes[i]);
+		rv |= test_scenario (sc, path, label, blocksizes[i], NULL, 0, false, sc->tolerance);
+	}
+
+	/* random mixes of small and large cycles */
+	for (uint32_t mix = 1; mix <= 4; ++mix) {
+		uint32_t blocks[97];
+		uint32_t seed = mix;
+		for (uint32_t i = 0; i < 97; ++i) {
+			seed = seed * 1103515245 + 12345;
+			const uint32_t r = seed >> 8;
+			blocks[i] = 1 + r % ((r & 1) ? 16 : 4096);
+		}
+		snprintf (label, sizeof (label), ", random mix %u", mix);
+		rv |= test_scenario (sc, path, label, 0, blocks, 97, false, sc->tolerance);
+		snprintf (label, sizeof (label), ", random mix %u, freewheel", mix);
+		rv |= test_scenario (sc, path, label, 0, blocks, 97, true, sc->tolerance);
+	}
+	return rv;
+}
+
+static int
+run_scenario (const Scenario* sc, const char* golden_dir, uint32_t blocksize, bool update, bool print, bool timing)
+{
+	char path[1024];
+	snprintf (path, sizeof (path), "%s/%s.txt", golden_dir, sc->name);
+
+	if (print) {
+		return render (sc, stdout, blocksize, NULL, 0, false);
+	}
+
+	if (update) {
+		FILE* f = fopen (path, "w");
+		if (!f) {
+			fprintf (stderr, "Cannot write '%s'\n", path);
+			return -1;
+		}
+		const int rv = render (sc, f, blocksize, NULL, 0, false);
+		fclose (f);
+		return rv;
+	}
+
+	if (timing) {
+		return test_timing (sc, path);
+	}
+	return test_scenario (sc, path, "", blocksize, NULL, 0, false, 0);
+}
+
+static void
+usage (int status)
+{
+	printf ("stepseq-check - Golden-output regression tests.\n\n"
+	        "Usage: stepseq-check [ OPTIONS ] [ scenario ... ]\n\n"
+	        "Options:\n"
+	        "  -B, --blocksize <num>    samples per run() call (default 256)\n"
+	        "  -f, --fixtures <dir>     directory of MIDI files to import (default tools/fixtures)\n"
+	        "  -g, --golden <dir>       directory of golden files (default tools/golden)\n"
+	        "  -h, --help               display this help and exit\n"
+	        "  -l, --list               list scenarios and exit\n"
+	        "  -p, --print              print the output of the scenario(s)\n"
+	        "  -t, --timing             test with different block sizes\n"
+	        "  -u, --update             (re)generate golden files\n"
+	        "\n"
+	        "Without scenario arguments, all scenarios are tested.\n");
+	exit (status);
+}
+
+static const struct option long_options[] = {
+	{ "blocksize", required_argument, 0, 'B' },
+	{ "fixtures",  required_argument, 0, 'f' },
+	{ "golden",    required_argument, 0, 'g' },
+	{ "help",      no_argument,       0, 'h' },
+	{ "list",      no_argument,       0, 'l' },
+	{ "print",     no_argument,       0, 'p' },
+	{ "timing",    no_argument,       0, 't' },
+	{ "update",    no_argument,       0, 'u' },
+	{ 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	const char* golden_dir = "tools/golden";
+	uint32_t    blocksize  = 256;
+	bool        print      = false;
+	bool        update     = false;
+	bool        timing     = false;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "B:f:g:hlptu", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'B':
+				blocksize = atoi (optarg);
+				break;
+			case 'f':
+				fixture_dir = optarg;
+				break;
+			case 'g':
+				golden_dir = optarg;
+				break;
+			case 'h':
+				usage (0);
+				break;
+			case 'l':
+				for (uint32_t i = 0; i < N_SCENARIOS; ++i) {
+					printf ("%-12s %s\n", scenarios[i].name, scenarios[i].desc);
+				}
+				return 0;
+			case 'p':
+				print = true;
+				break;
+			case 't':
+				timing = true;
+				break;
+			case 'u':
+				update = true;
+				break;
+			default:
+				usage (1);
+				break;
+		}
+	}
+
+	if (blocksize < 1 || blocksize > 8192) {
+		fprintf (stderr, "Invalid blocksize\n");
+		return 1;
+	}
+
+	int n_run  = 0;
+	int n_fail = 0;
+
+	for (uint32_t i = 0; i < N_SCENARIOS; ++i) {
+		const Scenario* sc = &scenarios[i];
+		if (optind < argc) {
+			bool match = false;
+			for (int a = optind; a < argc; ++a) {
+				match |= !strcmp (argv[a], sc->name);
+			}
+			if (!match) {
+				continue;
+			}
+		}
+		++n_run;
+		if (run_scenario (sc, golden_dir, blocksize, update, print, timing && !update)) {
+			++n_fail;
+		}
+	}
+
+	if (n_run == 0) {
+		fprintf (stderr, "No matching scenario\n");
+		return 1;
+	}
+	if (!print) {
+		fprintf (stderr, "%s %d scenario%s, %d failed\n", update ? "Updated" : "Tested", n_run, n_run > 1 ? "s" : "", n_fail);
+	}
+	return n_fail > 0 ? 1 : 0;
+}
@@ -0,0 +1,538 @@
+/* stepseq -- fuzz target for run()
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The input is a sequence of cycles. Each cycle sets control ports to
+ * arbitrary values (NaN, negative, huge, ...), adds time:Position and
+ * patch:Set objects with missing keys and wrong types, MIDI input
+ * (clock, song position, ...) and runs the plugin with a random block size.
+ *
+ * After every cycle the output and the plugin's state are checked:
+ * events are valid MIDI, in order and inside the cycle, no events are
+ * lost, and every note that is on at the output is known to the plugin's
+ * note tracker, so it will eventually be released. A violation aborts.
+ *
+ * The input is also parsed as a Standard MIDI File, as it would be when
+ * imported, and the resulting pattern has to be valid.
+ *
+ * Build with -DFUZZ_STANDALONE to replay files or run random inputs
+ * without libFuzzer.
+ */
+
+#include "host.h"
+
+#include <float.h>
+#include <inttypes.h>
+
+#define FUZZ_MAX_CYCLES 512
+#define FUZZ_MAX_BLOCK  8192
+
+#define FUZZ_CHECK(cond, ...)                                   \
+	do {                                                          \
+		if (!(cond)) {                                              \
+			fprintf (stderr, "stepseq-fuzz: cycle %u: ", ctx->cycle); \
+			fprintf (stderr, __VA_ARGS__);                            \
+			fprintf (stderr, "\n");                                   \
+			abort ();                                                 \
+		}                                                           \
+	} while (0)
+
+typedef struct {
+	const uint8_t* data;
+	size_t         size;
+} FuzzInput;
+
+typedef struct {
+	FuzzInput   in;
+	StepSeqHost host;
+	uint32_t    cycle;
+
+	/* objects and MIDI events to add to the next cycle's input */
+	uint32_t n_objects;
+	uint32_t n_midi;
+
+	/* output of the current cycle */
+	int64_t  start;
+	uint32_t n_samples;
+	int64_t  last[N_OUTS];
+	uint32_t n_out;
+
+	/* notes that are on at the output */
+	bool on[N_OUTS][16][128];
+} FuzzCtx;
+
+static uint8_t
+fuzz_u8 (FuzzInput* in)
+{
+	if (in->size == 0) {
+		return 0;
+	}
+	--in->size;
+	return *in->data++;
+}
+
+static uint32_t
+fuzz_u16 (FuzzInput* in)
+{
+	return fuzz_u8 (in) | (fuzz_u8 (in) << 8);
+}
+
+static uint32_t
+fuzz_u32 (FuzzInput* in)
+{
+	return fuzz_u16 (in) | (fuzz_u16 (in) << 16);
+}
+
+/** a control value, mostly edge cases and values in the ports' ranges */
+static float
+fuzz_float (FuzzInput* in)
+{
+	static const float special[] = {
+		NAN, -NAN, INFINITY, -INFINITY, 0.f, -0.f, -1.f, .25f, .5f, 1.f, 2.f, 3.f, 9.f,
+		10.f, 15.f, 16.f, 17.f, 60.f, 93.7f, 120.f, 127.f, 128.f, 255.f, 1000.f, 1e9f, -1e9f,
+		FLT_MAX, -FLT_MAX, FLT_MIN, FLT_EPSILON, 1e-40f
+	};
+	const uint8_t sel = fuzz_u8 (in);
+	if (sel < 0x80) {
+		return special[sel % (sizeof (special) / sizeof (special[0]))];
+	}
+	if (sel < 0xc0) {
+		return (float)(sel - 0xa0);
+	}
+	const uint32_t bits = fuzz_u32 (in);
+	float f;
+	memcpy (&f, &bits, sizeof (f));
+	return f;
+}
+
+/** write a value of a random type, mostly `expected` */
+static void
+fuzz_forge_value (FuzzInput* in, LV2_Atom_Forge* forge, LV2_URID_Map* map, LV2_URID expected)
+{
+	const uint8_t sel = fuzz_u8 (in);
+	LV2_URID type = expected;
+	switch (sel & 7) {
+		case 0: type = forge->Float; break;
+		case 1: type = forge->Long; break;
+		case 2: type = forge->Int; break;
+		case 3: type = forge->Double; break;
+		case 4: type = forge->Bool; break;
+		default: break;
+	}
+	const float f = fuzz_float (in);
+	if (type == forge->Float) {
+		lv2_atom_forge_float (forge, f);
+	} else if (type == forge->Double) {
+		lv2_atom_forge_double (forge, f);
+	} else if (type == forge->Long) {
+		lv2_atom_forge_long (forge, (sel & 8) ? (int64_t)fuzz_u32 (in) << 16 : (int64_t)(int32_t)fuzz_u32 (in));
+	} else if (type == forge->Int) {
+		lv2_atom_forge_int (forge, (sel & 8) ? (int32_t)fuzz_u32 (in) : (int8_t)fuzz_u8 (in));
+	} else if (type == forge->Bool) {
+		lv2_atom_forge_bool (forge, sel & 8);
+	} else if (type == forge->Path) {
+		/* do not let the worker read arbitrary files */
+		const char* path = (sel & 8) ? "/nonexistent/stepseq-fuzz.mid" : "";
+		lv2_atom_forge_path (forge, path, strlen (path));
+	} else {
+		lv2_atom_forge_urid (forge, fuzz_u8 (in) % 64);
+	}
+}
+
+/** a time:Position with random keys, types and values */
+static void
+fuzz_forge_position (FuzzInput* in, LV2_Atom_Forge* forge, LV2_URID_Map* map)
+{
+	static const char* keys[] = {
+		LV2_TIME__frame, LV2_TIME__bar, LV2_TIME__barBeat, LV2_TIME__beatUnit,
+		LV2_TIME__beatsPerBar, LV2_TIME__beatsPerMinute, LV2_TIME__speed
+	};
+	LV2_URID types[] = { forge->Long, forge->Long, forge->Float, forge->Int, forge->Float, forge->Float, forge->Float };
+
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_object (forge, &frame, 0, map->map (map->handle, LV2_TIME__Position));
+	const uint8_t present = fuzz_u8 (in);
+	for (uint32_t k = 0; k < sizeof (keys) / sizeof (keys[0]); ++k) {
+		if (present & (1 << k)) {
+			continue;
+		}
+		lv2_atom_forge_key (forge, map->map (map->handle, keys[k]));
+		fuzz_forge_value (in, forge, map, types[k]);
+	}
+	lv2_atom_forge_pop (forge, &frame);
+}
+
+/** a patch:Set, the SMF import or an unknown property */
+static void
+fuzz_forge_patch (FuzzInput* in, LV2_Atom_Forge* forge, LV2_URID_Map* map)
+{
+	const uint8_t sel = fuzz_u8 (in);
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_object (forge, &frame, 0, map->map (map->handle, LV2_PATCH__Set));
+	if (!(sel & 1)) {
+		lv2_atom_forge_key (forge, map->map (map->handle, LV2_PATCH__property));
+		lv2_atom_forge_urid (forge, map->map (map->handle, (sel & 2) ? STATE_URI "#smf" : STATE_URI "#pattern"));
+	}
+	if (!(sel & 4)) {
+		lv2_atom_forge_key (forge, map->map (map->handle, LV2_PATCH__value));
+		fuzz_forge_value (in, forge, map, forge->Path);
+	}
+	lv2_atom_forge_pop (forge, &frame);
+}
+
+/** add objects and MIDI input, events are not necessarily in order */
+static void
+fuzz_forge (void* arg, LV2_Atom_Forge* forge, uint32_t n_samples)
+{
+	FuzzCtx*      ctx = (FuzzCtx*)arg;
+	FuzzInput*    in  = &ctx->in;
+	LV2_URID_Map* map = &ctx->host.map;
+
+	for (uint32_t i = 0; i < ctx->n_objects; ++i) {
+		const uint8_t sel = fuzz_u8 (in);
+		lv2_atom_forge_frame_time (forge, n_samples > 0 ? fuzz_u16 (in) % n_samples : 0);
+		if (sel & 1) {
+			fuzz_forge_patch (in, forge, map);
+		} else {
+			fuzz_forge_position (in, forge, map);
+		}
+	}
+
+	for (uint32_t i = 0; i < ctx->n_midi; ++i) {
+		static const uint8_t status[] = { 0xf8, 0xf8, 0xf8, 0xfa, 0xfb, 0xfc, 0xf2, 0xff, 0x90, 0x80, 0xb0 };
+		const uint8_t sel = fuzz_u8 (in);
+		uint8_t buf[3];
+		buf[0] = (sel & 0x80) ? fuzz_u8 (in) : status[sel % sizeof (status)];
+		buf[1] = fuzz_u8 (in);
+		buf[2] = fuzz_u8 (in);
+		uint32_t size = (sel >> 4) & 3;
+		if (size == 0 && !(sel & 8)) {
+			size = buf[0] == 0xf2 ? 3 : 1;
+		}
+		lv2_atom_forge_frame_time (forge, n_samples > 0 ? fuzz_u16 (in) % n_samples : 0);
+		lv2_atom_forge_atom (forge, size, map->map (map->handle, LV2_MIDI__MidiEvent));
+		lv2_atom_forge_write (forge, buf, size);
+	}
+}
+
+/** update the state of notes on a port */
+static void
+track_notes (bool on[16][128], const uint8_t* buf, uint32_t size)
+{
+	if (size != 3 || buf[0] >= 0xf0) {
+		return;
+	}
+	const uint8_t chn = buf[0] & 0x0f;
+	switch (buf[0] & 0xf0) {
+		case 0x90:
+			on[chn][buf[1]] = buf[2] > 0;
+			break;
+		case 0x80:
+			on[chn][buf[1]] = false;
+			break;
+		case 0xb0:
+			if (buf[1] == 0x7b) {
+				memset (on[chn], 0, sizeof (on[chn]));
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+fuzz_event (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size)
+{
+	FuzzCtx* ctx = (FuzzCtx*)arg;
+
+	++ctx->n_out;
+	FUZZ_CHECK (frame >= ctx->start && frame < ctx->start + ctx->n_samples,
+	            "event at %" PRId64 " outside of the cycle %" PRId64 " + %u", frame - ctx->start, ctx->start, ctx->n_samples);
+	FUZZ_CHECK (frame >= ctx->last[port], "events on port %u are not in order", port);
+	ctx->last[port] = frame;
+
+	FUZZ_CHECK (size >= 1 && size <= 3 && (buf[0] & 0x80), "invalid MIDI message, size %u", size);
+	for (uint32_t i = 1; i < size; ++i) {
+		FUZZ_CHECK (!(buf[i] & 0x80), "invalid MIDI data byte %02x", buf[i]);
+	}
+	FUZZ_CHECK (size == 3 || (buf[0] & 0xe0) != 0x80, "note event with size %u", size);
+	track_notes (ctx->on[port], buf, size);
+}
+
+static void
+fuzz_log (void* arg, int64_t frame, const char* msg)
+{
+	FuzzCtx* ctx = (FuzzCtx*)arg;
+	/* the plugin's note tracker is out of sync with its output */
+	FUZZ_CHECK (!strstr (msg, "already off"), "%s", msg);
+}
+
+/** the plugin's state after a cycle */
+static void
+fuzz_check_state (FuzzCtx* ctx)
+{
+	const StepSeq* self = (const StepSeq*)ctx->host.instance;
+
+	FUZZ_CHECK (self->step >= 0 && self->step < N_STEPS, "step %d out of range", self->step);
+	FUZZ_CHECK (isfinite (self->stme), "stme is not finite");
+	FUZZ_CHECK (isfinite (self->sps) && self->sps >= 64, "invalid step duration %f", self->sps);
+	FUZZ_CHECK (self->n_events < MAX_EVENTS, "event queue overflow, events were lost");
+	FUZZ_CHECK (self->n_carried == self->n_events, "%u events pending, %u carried", self->n_events, self->n_carried);
+	FUZZ_CHECK (ctx->n_out < MAX_EVENTS, "%u events in one cycle", ctx->n_out);
+
+	/* not updated while freewheeling, and possibly never written */
+	const float step = ctx->host.ports[PORT_STEP];
+	FUZZ_CHECK (ctx->host.ports[PORT_FREEWHEEL] > 0 || (step >= 1 && step <= N_STEPS), "step output port %f", step);
+
+	/* a note that is on at the output must be known to the note tracker,
+	 * otherwise it is never released. Carried events are already tracked.
+	 */
+	bool on[N_OUTS][16][128];
+	memcpy (on, ctx->on, sizeof (on));
+	for (uint32_t i = 0; i < self->n_events; ++i) {
+		track_notes (on[self->events[i].port], self->events[i].buf, self->events[i].size);
+	}
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		for (uint32_t c = 0; c < 16; ++c) {
+			for (uint32_t n = 0; n < 128; ++n) {
+				FUZZ_CHECK (!on[p][c][n] || self->active[p * 16 + c][n] > 0,
+				            "stuck note %u on channel %u, port %u", n, c + 1, p);
+			}
+		}
+	}
+}
+
+static void
+fuzz_cycle (FuzzCtx* ctx, uint32_t n_samples)
+{
+	StepSeqHost* h = &ctx->host;
+
+	ctx->start     = h->time;
+	ctx->n_samples = n_samples;
+	ctx->n_out     = 0;
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		ctx->last[p] = h->time;
+	}
+
+	host_cycle_begin (h, n_samples);
+	h->desc->run (h->instance, n_samples);
+	host_cycle_end (h, n_samples, fuzz_event, ctx);
+
+	fuzz_check_state (ctx);
+	++ctx->cycle;
+}
+
+static bool
+is_control_input (uint32_t p)
+{
+	switch (p) {
+		case PORT_CTRL_IN:
+		case PORT_MIDI_OUT:
+		case PORT_STEP:
+		case PORT_HOSTBPM:
+		case PORT_SEEKS:
+		case PORT_LATENCY:
+			return false;
+		default:
+			break;
+	}
+	return !(p >= PORT_MIDI_OUTS && p < PORT_MIDI_OUTS + N_OUTS - 1) && p <= PORT_FREEWHEEL;
+}
+
+int
+LLVMFuzzerTestOneInput (const uint8_t* data, size_t size)
+{
+	static const double rates[] = { 22050, 44100, 48000, 88200, 96000, 192000 };
+	static FuzzCtx fctx;
+	FuzzCtx* ctx = &fctx;
+
+	memset (ctx, 0, sizeof (FuzzCtx));
+	ctx->in.data = data;
+	ctx->in.size = size;
+
+	StepSeqPattern pat;
+	memset (&pat, 0, sizeof (pat));
+	if (smf_parse (data, size, 0.5f, &pat) == 0) {
+		for (uint32_t i = 0; i < N_NOTES * N_STEPS; ++i) {
+			FUZZ_CHECK (pat.vel[i] < 128, "SMF import, invalid velocity %u", pat.vel[i]);
+		}
+		for (uint32_t n = 0; n < N_NOTES; ++n) {
+			FUZZ_CHECK (pat.note[n] < 128, "SMF import, invalid note %u", pat.note[n]);
+		}
+	}
+
+	StepSeqHost* h = &ctx->host;
+	if (host_init (h, rates[fuzz_u8 (&ctx->in) % (sizeof (rates) / sizeof (rates[0]))])) {
+		abort ();
+	}
+	h->log_cb    = fuzz_log;
+	h->log_arg   = ctx;
+	h->forge_cb  = fuzz_forge;
+	h->forge_arg = ctx;
+
+	/* a dense pattern on all outputs and channels */
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		for (uint32_t s = 0; s < N_STEPS; ++s) {
+			host_set_cell (h, n, s, ((n + s) % 3) ? 100 : 0);
+		}
+	}
+
+	while (ctx->in.size > 0 && ctx->cycle < FUZZ_MAX_CYCLES) {
+		const uint8_t op = fuzz_u8 (&ctx->in);
+		for (uint32_t i = 0; i < (op & 7u); ++i) {
+			const uint32_t p = fuzz_u8 (&ctx->in) % HOST_N_PORTS;
+			const float    v = fuzz_float (&ctx->in);
+			if (is_control_input (p)) {
+				h->ports[p] = v;
+			}
+		}
+		ctx->n_objects = (op >> 3) & 3;
+		ctx->n_midi    = (op >> 5) & 7;
+		fuzz_cycle (ctx, fuzz_u16 (&ctx->in) % (FUZZ_MAX_BLOCK + 1));
+	}
+
+	/* panic releases all notes, and nothing is played while it is held */
+	ctx->n_objects = ctx->n_midi = 0;
+	h->ports[PORT_PANIC] = 1;
+	fuzz_cycle (ctx, 64);
+	fuzz_cycle (ctx, 64);
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		for (uint32_t c = 0; c < 16; ++c) {
+			for (uint32_t n = 0; n < 128; ++n) {
+				FUZZ_CHECK (!ctx->on[p][c][n], "note %u on channel %u, port %u not released by panic", n, c + 1, p);
+			}
+		}
+	}
+
+	host_cleanup (h);
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <getopt.h>
+
+static int
+run_file (const char* path)
+{
+	FILE* f = fopen (path, "rb");
+	if (!f) {
+		fprintf (stderr, "Cannot open '%s'\n", path);
+		return -1;
+	}
+	uint8_t* data = NULL;
+	size_t   size = 0;
+	uint8_t  buf[4096];
+	size_t   n;
+	while ((n = fread (buf, 1, sizeof (buf), f)) > 0) {
+		uint8_t* d = (uint8_t*)realloc (data, size + n);
+		if (!d) {
+			free (data);
+			fclose (f);
+			return -1;
+		}
+		data = d;
+		memcpy (data + size, buf, n);
+		size += n;
+	}
+	fclose (f);
+	LLVMFuzzerTestOneInput (data, size);
+	free (data);
+	return 0;
+}
+
+static void
+usage (int status)
+{
+	printf ("stepseq-fuzz-run - Run the fuzz target without libFuzzer.\n\n"
+	        "Usage: stepseq-fuzz-run [ OPTIONS ] [ <file> ... ]\n\n"
+	        "Options:\n"
+	        "  -h, --help               display this help and exit\n"
+	        "  -n, --runs <num>         number of random inputs (default 10000)\n"
+	        "  -s, --seed <num>         seed of the first random input (default 1)\n"
+	        "  -v, --verbose            print the seed of every random input\n"
+	        "\n"
+	        "Replays the given files (e.g. crash reports from libFuzzer), or runs\n"
+	        "random inputs if no file is given. A failed check aborts.\n");
+	exit (status);
+}
+
+static const struct option long_options[] = {
+	{ "help",    no_argument,       0, 'h' },
+	{ "runs",    required_argument, 0, 'n' },
+	{ "seed",    required_argument, 0, 's' },
+	{ "verbose", no_argument,       0, 'v' },
+	{ 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	uint32_t runs = 10000;
+	uint32_t seed = 1;
+	bool     verbose = false;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "hn:s:v", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'h':
+				usage (0);
+				break;
+			case 'n':
+				runs = atoi (optarg);
+				break;
+			case 's':
+				seed = atoi (optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage (1);
+				break;
+		}
+	}
+
+	if (optind < argc) {
+		for (int i = optind; i < argc; ++i) {
+			if (run_file (argv[i])) {
+				return 1;
+			}
+		}
+		printf ("Replayed %d files\n", argc - optind);
+		return 0;
+	}
+
+	static uint8_t data[8192];
+	for (uint32_t r = 0; r < runs; ++r) {
+		/* every input depends on its seed only, to reproduce it with -n 1 -s <seed> */
+		uint32_t s = seed + r;
+		if (verbose) {
+			printf ("seed %u\n", s);
+			fflush (stdout);
+		}
+		s = s * 1103515245 + 12345;
+		const size_t size = (s >> 8) % sizeof (data);
+		for (size_t i = 0; i < size; ++i) {
+			s = s * 1103515245 + 12345;
+			data[i] = s >> 16;
+		}
+		LLVMFuzzerTestOneInput (data, size);
+	}
+	printf ("Ran %u random inputs\n", runs);
+	return 0;
+}
+#endif
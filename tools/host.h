@@ -0,0 +1,725 @@
+/* stepseq -- minimal in-process LV2 host for tools and tests
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The plugin is compiled into the tool, N_NOTES, N_STEPS and N_OUTS
+ * are set the same way as for the plugin.
+ *
+ * With HOST_DLOPEN, the plugin is instead loaded from a shared object
+ * built with the same settings, see host_open (). Tools then only have
+ * access to the plugin's port indices.
+ */
+#ifdef HOST_DLOPEN
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LV2_1_18_6
+#include <lv2/atom/atom.h>
+#include <lv2/atom/forge.h>
+#include <lv2/core/lv2.h>
+#include <lv2/log/log.h>
+#include <lv2/midi/midi.h>
+#include <lv2/patch/patch.h>
+#include <lv2/state/state.h>
+#include <lv2/time/time.h>
+#include <lv2/urid/urid.h>
+#include <lv2/worker/worker.h>
+#else
+#include <lv2/lv2plug.in/ns/lv2core/lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/log/log.h>
+#include <lv2/lv2plug.in/ns/ext/midi/midi.h>
+#include <lv2/lv2plug.in/ns/ext/patch/patch.h>
+#include <lv2/lv2plug.in/ns/ext/state/state.h>
+#include <lv2/lv2plug.in/ns/ext/time/time.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
+#endif
+
+#include "../src/stepseq.h"
+
+#define HOST_WORK_SIZE 4096
+
+static LV2_Descriptor_Function lv2_descriptor = NULL;
+
+/** load the plugin, must be called before host_init () */
+static int
+host_open (const char* path)
+{
+	void* lib = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+	if (!lib) {
+		fprintf (stderr, "%s\n", dlerror ());
+		return -1;
+	}
+	lv2_descriptor = (LV2_Descriptor_Function)dlsym (lib, "lv2_descriptor");
+	const LV2_Descriptor* desc = lv2_descriptor ? lv2_descriptor (0) : NULL;
+	if (!desc || strcmp (desc->URI, SEQ_URI)) {
+		fprintf (stderr, "'%s' is not a %s plugin\n", path, SEQ_URI);
+		dlclose (lib);
+		lv2_descriptor = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+#include "../src/stepseq.c"
+
+#define HOST_WORK_SIZE sizeof (SMFRequest)
+
+#endif
+
+#include <stdarg.h>
+
+#ifdef RT_AUDIT
+#include "rtaudit.h"
+#else
+#define rt_audit_begin()
+#define rt_audit_end()
+#define rt_audit_pause()
+#define rt_audit_resume()
+#endif
+
+#define HOST_N_PORTS   PORT_LAST
+#define HOST_CTRL_SIZE 8192
+#define HOST_MIDI_SIZE 65536
+#define HOST_MAX_URIS  128
+#define HOST_MAX_MIDI  64
+#define HOST_STATE_SIZE 65536
+
+/**
+ * called for every MIDI event produced by the plugin.
+ * `frame` is the sample-time since host_init (), counting all processed
+ * samples, regardless of transport state.
+ */
+typedef void (*HostMidiCallback) (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size);
+
+/** called for every message the plugin logs */
+typedef void (*HostLogCallback) (void* arg, int64_t frame, const char* msg);
+
+/** called by host_cycle_begin () to add events to the control input */
+typedef void (*HostForgeCallback) (void* arg, LV2_Atom_Forge* forge, uint32_t n_samples);
+
+/** called for every MIDI clock tick, also when it is dropped, with its time before jitter is added */
+typedef void (*HostClockCallback) (void* arg, int64_t tick, double time);
+
+typedef struct {
+	uint32_t frame;
+	uint32_t size;
+	uint8_t  buf[3];
+} HostMidiEvent;
+
+typedef struct {
+	const LV2_Descriptor* desc;
+	LV2_Handle            instance;
+	double                rate;
+
+	/* URID map */
+	char*               uris[HOST_MAX_URIS];
+	uint32_t            n_uris;
+	LV2_URID_Map        map;
+	LV2_Worker_Schedule schedule;
+	LV2_Log_Log         log;
+	LV2_Feature         map_feature;
+	LV2_Feature         schedule_feature;
+	LV2_Feature         log_feature;
+	const LV2_Feature*  features[4];
+
+	/* log, messages are printed to stderr unless a callback is set */
+	HostLogCallback log_cb;
+	void*           log_arg;
+
+	/* worker, jobs are executed synchronously after run() */
+	const LV2_Worker_Interface* worker;
+	uint8_t                     work_buf[HOST_WORK_SIZE];
+	uint32_t                    work_size;
+
+	/* state, a single property is stored */
+	const LV2_State_Interface* state;
+	uint8_t                    state_buf[HOST_STATE_SIZE];
+	size_t                     state_size;
+	uint32_t                   state_key;
+	uint32_t                   state_type;
+
+	/* ports */
+	float   ports[HOST_N_PORTS];
+	/* atom buffers, 64-bit aligned */
+	uint64_t ctrl_in[HOST_CTRL_SIZE / 8];
+	uint64_t midi_out[N_OUTS][HOST_MIDI_SIZE / 8];
+	LV2_Atom_Forge forge;
+
+	/* additional control input, after position and SMF, before MIDI */
+	HostForgeCallback forge_cb;
+	void*             forge_arg;
+
+	/* MIDI input for the next cycle */
+	HostMidiEvent midi_in[HOST_MAX_MIDI];
+	uint32_t      n_midi_in;
+
+	/* samples processed since host_init () */
+	int64_t time;
+
+	/* transport, bpm and position are in units of beat_unit */
+	bool    transport;
+	bool    rolling;
+	double  bpm;
+	float   beats_per_bar;
+	int     beat_unit;
+	double  beats0; // position at frame0, set by locate and tempo changes
+	int64_t frame0;
+	int64_t frame;
+	char    smf_path[1024];
+
+	/* send time:Position only when the transport changes (default: every cycle) */
+	bool    pos_on_change;
+	double  pos_jitter; // max. deviation of the position sent, in beats
+	bool    pos_dirty;
+	bool    pos_rolling; // rolling state of the last position sent
+
+	/* MIDI clock master, ticks are sent to the control input */
+	bool    mclk;
+	bool    mclk_start;
+	double  mclk_t0;   // time of tick mclk_k0
+	int64_t mclk_k0;
+	int64_t mclk_next; // next tick to send
+	double  mclk_jitter;   // max. deviation of tick times in samples
+	uint32_t mclk_seed;
+	int64_t mclk_drop_end; // ticks before this one are dropped
+	HostClockCallback mclk_cb;
+	void*             mclk_arg;
+} StepSeqHost;
+
+static LV2_URID
+host_uri_map (LV2_URID_Map_Handle handle, const char* uri)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	for (uint32_t i = 0; i < h->n_uris; ++i) {
+		if (!strcmp (h->uris[i], uri)) {
+			return i + 1;
+		}
+	}
+	if (h->n_uris >= HOST_MAX_URIS) {
+		return 0;
+	}
+	h->uris[h->n_uris] = strdup (uri);
+	return ++h->n_uris;
+}
+
+static LV2_Worker_Status
+host_schedule_work (LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	if (h->work_size > 0 || size > sizeof (h->work_buf)) {
+		return LV2_WORKER_ERR_NO_SPACE;
+	}
+	memcpy (h->work_buf, data, size);
+	h->work_size = size;
+	return LV2_WORKER_SUCCESS;
+}
+
+static int
+host_log_vprintf (LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list args)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	rt_audit_pause ();
+	if (!h->log_cb) {
+		const int rv = vfprintf (stderr, fmt, args);
+		rt_audit_resume ();
+		return rv;
+	}
+	char msg[256];
+	const int rv = vsnprintf (msg, sizeof (msg), fmt, args);
+	/* strip trailing newline */
+	size_t len = strlen (msg);
+	while (len > 0 && msg[len - 1] == '\n') {
+		msg[--len] = '\0';
+	}
+	h->log_cb (h->log_arg, h->time, msg);
+	rt_audit_resume ();
+	return rv;
+}
+
+static int
+host_log_printf (LV2_Log_Handle handle, LV2_URID type, const char* fmt, ...)
+{
+	va_list args;
+	va_start (args, fmt);
+	const int rv = host_log_vprintf (handle, type, fmt, args);
+	va_end (args);
+	return rv;
+}
+
+static LV2_Worker_Status
+host_work_respond (LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	return h->worker->work_response (h->instance, size, data);
+}
+
+static LV2_State_Status
+host_state_store (LV2_State_Handle handle, uint32_t key, const void* value, size_t size, uint32_t type, uint32_t flags)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	if (size > sizeof (h->state_buf)) {
+		return LV2_STATE_ERR_UNKNOWN;
+	}
+	memcpy (h->state_buf, value, size);
+	h->state_size = size;
+	h->state_key  = key;
+	h->state_type = type;
+	return LV2_STATE_SUCCESS;
+}
+
+static const void*
+host_state_retrieve (LV2_State_Handle handle, uint32_t key, size_t* size, uint32_t* type, uint32_t* flags)
+{
+	StepSeqHost* h = (StepSeqHost*)handle;
+	if (h->state_size == 0 || key != h->state_key) {
+		return NULL;
+	}
+	*size  = h->state_size;
+	*type  = h->state_type;
+	*flags = LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE;
+	return h->state_buf;
+}
+
+/** default note-number of a row, same as gridgen.sh */
+static int
+host_default_note (uint32_t row)
+{
+	static const int twelvetet[7] = { 11, 1, 3, 5, 6, 8, 10 };
+	const uint32_t n = row + 1;
+	return 70 - 12 * (int)((n - 1) / 7) - twelvetet[n % 7];
+}
+
+static int
+host_init (StepSeqHost* h, double rate)
+{
+	memset (h, 0, sizeof (StepSeqHost));
+
+	h->rate          = rate;
+	h->bpm           = 120;
+	h->beats_per_bar = 4;
+	h->beat_unit     = 4;
+
+	h->map.handle                  = h;
+	h->map.map                     = host_uri_map;
+	h->schedule.handle             = h;
+	h->schedule.schedule_work      = host_schedule_work;
+	h->log.handle                  = h;
+	h->log.printf                  = host_log_printf;
+	h->log.vprintf                 = host_log_vprintf;
+	h->map_feature.URI             = LV2_URID__map;
+	h->map_feature.data            = &h->map;
+	h->schedule_feature.URI        = LV2_WORKER__schedule;
+	h->schedule_feature.data       = &h->schedule;
+	h->features[0]                 = &h->map_feature;
+	h->features[1]                 = &h->schedule_feature;
+	h->log_feature.URI             = LV2_LOG__log;
+	h->log_feature.data            = &h->log;
+	h->features[2]                 = &h->log_feature;
+	h->features[3]                 = NULL;
+
+	h->desc     = lv2_descriptor (0);
+	h->instance = h->desc->instantiate (h->desc, rate, "", h->features);
+	if (!h->instance) {
+		return -1;
+	}
+	h->worker = (const LV2_Worker_Interface*)h->desc->extension_data (LV2_WORKER__interface);
+	h->state  = (const LV2_State_Interface*)h->desc->extension_data (LV2_STATE__interface);
+	lv2_atom_forge_init (&h->forge, &h->map);
+
+	/* port defaults, see lv2ttl/stepseq.ttl.in and gridgen.sh */
+	h->ports[PORT_BPM]     = 120;
+	h->ports[PORT_DIVIDER] = 3;
+	for (uint32_t n = 0; n < N_NOTES; ++n) {
+		h->ports[PORT_NOTES + n]  = host_default_note (n);
+		h->ports[PORT_ROWCHN + n] = -1;
+#if N_OUTS > 1
+		h->ports[PORT_ROWOUT + n] = 1;
+#endif
+	}
+
+	for (uint32_t p = 0; p < HOST_N_PORTS; ++p) {
+		if (p == PORT_CTRL_IN) {
+			h->desc->connect_port (h->instance, p, h->ctrl_in);
+		} else if (p == PORT_MIDI_OUT) {
+			h->desc->connect_port (h->instance, p, h->midi_out[0]);
+		} else if (p >= PORT_MIDI_OUTS && p < PORT_MIDI_OUTS + N_OUTS - 1) {
+			h->desc->connect_port (h->instance, p, h->midi_out[1 + p - PORT_MIDI_OUTS]);
+		} else {
+			h->desc->connect_port (h->instance, p, &h->ports[p]);
+		}
+	}
+
+	h->desc->activate (h->instance);
+	return 0;
+}
+
+static void
+host_cleanup (StepSeqHost* h)
+{
+	if (h->instance) {
+		if (h->desc->deactivate) {
+			h->desc->deactivate (h->instance);
+		}
+		h->desc->cleanup (h->instance);
+	}
+	for (uint32_t i = 0; i < h->n_uris; ++i) {
+		free (h->uris[i]);
+	}
+	h->instance = NULL;
+	h->n_uris   = 0;
+}
+
+/** enable synthetic host transport, the sync port is set to "Host Sync" */
+static void
+host_set_transport (StepSeqHost* h, double bpm, float beats_per_bar, int beat_unit)
+{
+	h->transport     = true;
+	h->rolling       = true;
+	h->bpm           = bpm;
+	h->beats_per_bar = beats_per_bar;
+	h->beat_unit     = beat_unit;
+	h->pos_dirty     = true;
+	h->ports[PORT_SYNC] = 1;
+}
+
+/**
+ * transport position in beats (beat_unit).
+ * It is calculated from the last locate or tempo change, and does
+ * not depend on how time was split into cycles.
+ */
+static double
+host_beats (const StepSeqHost* h)
+{
+	return h->beats0 + (h->frame - h->frame0) * h->bpm / (60.0 * h->rate);
+}
+
+static double
+host_mclk_period (const StepSeqHost* h)
+{
+	return h->rate * 60.0 / (24.0 * h->bpm);
+}
+
+/** set the tempo, the position is retained */
+static void
+host_set_bpm (StepSeqHost* h, double bpm)
+{
+	h->beats0 = host_beats (h);
+	h->frame0 = h->frame;
+	if (h->mclk) {
+		h->mclk_t0 += (h->mclk_next - h->mclk_k0) * host_mclk_period (h);
+		h->mclk_k0  = h->mclk_next;
+	}
+	h->bpm       = bpm;
+	h->pos_dirty = true;
+}
+
+/**
+ * act as MIDI clock master, the sync port is set to "MIDI Clock".
+ * A start message is sent with the next cycle, followed by ticks at `bpm`.
+ */
+static void
+host_set_mclk (StepSeqHost* h, double bpm)
+{
+	h->mclk       = true;
+	h->mclk_start = true;
+	h->mclk_t0    = h->time;
+	h->mclk_k0    = 0;
+	h->mclk_next  = 0;
+	h->mclk_drop_end = 0;
+	h->rolling    = true;
+	h->bpm        = bpm;
+	h->ports[PORT_SYNC] = 2;
+}
+
+/**
+ * add uniformly distributed jitter of up to +/- `samples` to the time of
+ * every MIDI clock tick. The jitter of a tick only depends on `seed` and
+ * the tick's index, not on how time is split into cycles.
+ */
+static void
+host_set_mclk_jitter (StepSeqHost* h, double samples, uint32_t seed)
+{
+	h->mclk_jitter = samples;
+	h->mclk_seed   = seed;
+}
+
+/** do not send the next `n_ticks` MIDI clock ticks */
+static void
+host_drop_mclk (StepSeqHost* h, int64_t n_ticks)
+{
+	h->mclk_drop_end = h->mclk_next + n_ticks;
+}
+
+/** locate the transport to the given position in beats (beat_unit) */
+static void
+host_locate (StepSeqHost* h, double beats)
+{
+	h->beats0 = beats;
+	h->frame0 = h->frame = llrint (beats * 60.0 * h->rate / h->bpm);
+	h->pos_dirty = true;
+}
+
+/** grid cell velocity, 0: off */
+static void
+host_set_cell (StepSeqHost* h, uint32_t row, uint32_t step, float vel)
+{
+	if (row < N_NOTES && step < N_STEPS) {
+		h->ports[PORT_GRID + row * N_STEPS + step] = vel;
+	}
+}
+
+static void
+host_set_note (StepSeqHost* h, uint32_t row, int note)
+{
+	if (row < N_NOTES) {
+		h->ports[PORT_NOTES + row] = note;
+	}
+}
+
+/** queue a MIDI message for the control input of the next cycle */
+static void
+host_queue_midi (StepSeqHost* h, uint32_t frame, const uint8_t* buf, uint32_t size)
+{
+	if (h->n_midi_in < HOST_MAX_MIDI && size > 0 && size <= 3) {
+		HostMidiEvent* ev = &h->midi_in[h->n_midi_in++];
+		ev->frame = frame;
+		ev->size  = size;
+		memcpy (ev->buf, buf, size);
+	}
+}
+
+/** import a pattern from a MIDI file with the next run () */
+static void
+host_load_smf (StepSeqHost* h, const char* path)
+{
+	snprintf (h->smf_path, sizeof (h->smf_path), "%s", path);
+}
+
+/** save the plugin's state, it replaces a previously saved one */
+static int
+host_save_state (StepSeqHost* h)
+{
+	h->state_size = 0;
+	return h->state->save (h->instance, host_state_store, h, 0, h->features) == LV2_STATE_SUCCESS ? 0 : -1;
+}
+
+/** set the pattern state to `size` bytes at `blob`, to be restored */
+static void
+host_set_state (StepSeqHost* h, const void* blob, size_t size)
+{
+	host_state_store (h, host_uri_map (h, STATE_URI "#pattern"), blob, size, host_uri_map (h, LV2_ATOM__Chunk), 0);
+}
+
+/** restore the last saved or set state, between two cycles */
+static int
+host_restore_state (StepSeqHost* h)
+{
+	return h->state->restore (h->instance, host_state_retrieve, h, 0, h->features) == LV2_STATE_SUCCESS ? 0 : -1;
+}
+
+/** hash of `i`, uniform in [-1, 1) */
+static double
+host_jitter (int64_t i, uint32_t seed)
+{
+	uint32_t r = (uint32_t)i * 2654435761u ^ seed;
+	r ^= r >> 15;
+	r *= 2246822519u;
+	r ^= r >> 13;
+	return r / 2147483648.0 - 1.0;
+}
+
+static void
+host_forge_position (StepSeqHost* h)
+{
+	LV2_Atom_Forge*      forge = &h->forge;
+	LV2_Atom_Forge_Frame frame;
+	const double  beats = host_beats (h) + h->pos_jitter * host_jitter (h->frame, 1);
+	const int64_t bar   = floor (beats / h->beats_per_bar);
+
+	lv2_atom_forge_frame_time (forge, 0);
+	lv2_atom_forge_object (forge, &frame, 0, h->map.map (h, LV2_TIME__Position));
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__frame));
+	lv2_atom_forge_long (forge, h->frame);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__bar));
+	lv2_atom_forge_long (forge, bar);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__barBeat));
+	lv2_atom_forge_float (forge, beats - bar * h->beats_per_bar);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__beatUnit));
+	lv2_atom_forge_int (forge, h->beat_unit);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__beatsPerBar));
+	lv2_atom_forge_float (forge, h->beats_per_bar);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__beatsPerMinute));
+	lv2_atom_forge_float (forge, h->bpm);
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_TIME__speed));
+	lv2_atom_forge_float (forge, h->rolling ? 1 : 0);
+	lv2_atom_forge_pop (forge, &frame);
+}
+
+static void
+host_forge_smf (StepSeqHost* h)
+{
+	LV2_Atom_Forge*      forge = &h->forge;
+	LV2_Atom_Forge_Frame frame;
+
+	lv2_atom_forge_frame_time (forge, 0);
+	lv2_atom_forge_object (forge, &frame, 0, h->map.map (h, LV2_PATCH__Set));
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_PATCH__property));
+	lv2_atom_forge_urid (forge, h->map.map (h, STATE_URI "#smf"));
+	lv2_atom_forge_key (forge, h->map.map (h, LV2_PATCH__value));
+	lv2_atom_forge_path (forge, h->smf_path, strlen (h->smf_path));
+	lv2_atom_forge_pop (forge, &frame);
+	h->smf_path[0] = '\0';
+}
+
+/** send a MIDI clock stop message, followed by no more ticks */
+static void
+host_stop_mclk (StepSeqHost* h)
+{
+	const uint8_t stop = 0xfc;
+	host_queue_midi (h, 0, &stop, 1);
+	h->rolling = false;
+}
+
+/** the MIDI clock ceases without a stop message, e.g. a cable is pulled */
+static void
+host_unplug_mclk (StepSeqHost* h)
+{
+	h->mclk_start    = false;
+	h->mclk_drop_end = INT64_MAX;
+}
+
+/** queue MIDI clock ticks for the next `n_samples` */
+static void
+host_queue_mclk (StepSeqHost* h, uint32_t n_samples)
+{
+	if (h->mclk_start) {
+		const uint8_t start = 0xfa;
+		host_queue_midi (h, 0, &start, 1);
+		h->mclk_start = false;
+	}
+	const uint8_t clk = 0xf8;
+	for (;;) {
+		const double t = h->mclk_t0 + (h->mclk_next - h->mclk_k0) * host_mclk_period (h);
+		const double jitter = h->mclk_jitter * host_jitter (h->mclk_next, h->mclk_seed);
+		const int64_t ts = floor (t + jitter) - h->time;
+		if (ts >= n_samples) {
+			break;
+		}
+		if (h->mclk_next >= h->mclk_drop_end) {
+			host_queue_midi (h, ts > 0 ? ts : 0, &clk, 1);
+		}
+		if (h->mclk_cb) {
+			h->mclk_cb (h->mclk_arg, h->mclk_next, t);
+		}
+		++h->mclk_next;
+	}
+}
+
+/** prepare input and output buffers for the next cycle of `n_samples` */
+static void
+host_cycle_begin (StepSeqHost* h, uint32_t n_samples)
+{
+	if (h->mclk && h->rolling) {
+		host_queue_mclk (h, n_samples);
+	}
+
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_set_buffer (&h->forge, (uint8_t*)h->ctrl_in, sizeof (h->ctrl_in));
+	lv2_atom_forge_sequence_head (&h->forge, &frame, 0);
+	if (h->transport && (!h->pos_on_change || h->pos_dirty || h->pos_rolling != h->rolling)) {
+		host_forge_position (h);
+		h->pos_dirty   = false;
+		h->pos_rolling = h->rolling;
+	}
+	if (h->smf_path[0]) {
+		host_forge_smf (h);
+	}
+	if (h->forge_cb) {
+		h->forge_cb (h->forge_arg, &h->forge, n_samples);
+	}
+	for (uint32_t i = 0; i < h->n_midi_in; ++i) {
+		lv2_atom_forge_frame_time (&h->forge, h->midi_in[i].frame);
+		lv2_atom_forge_atom (&h->forge, h->midi_in[i].size, h->map.map (h, LV2_MIDI__MidiEvent));
+		lv2_atom_forge_write (&h->forge, h->midi_in[i].buf, h->midi_in[i].size);
+	}
+	h->n_midi_in = 0;
+	lv2_atom_forge_pop (&h->forge, &frame);
+
+	for (uint32_t p = 0; p < N_OUTS; ++p) {
+		LV2_Atom_Sequence* seq = (LV2_Atom_Sequence*)h->midi_out[p];
+		seq->atom.type = 0;
+		seq->atom.size = HOST_MIDI_SIZE - sizeof (LV2_Atom);
+	}
+}
+
+/**
+ * dispatch MIDI output, run pending worker jobs and advance time.
+ * @return 0 on success, -1 if a worker job failed
+ */
+static int
+host_cycle_end (StepSeqHost* h, uint32_t n_samples, HostMidiCallback cb, void* arg)
+{
+	int rv = 0;
+	for (uint32_t p = 0; p < N_OUTS && cb; ++p) {
+		LV2_Atom_Sequence* seq = (LV2_Atom_Sequence*)h->midi_out[p];
+		LV2_ATOM_SEQUENCE_FOREACH (seq, ev) {
+			cb (arg, p, h->time + ev->time.frames, (const uint8_t*)(ev + 1), ev->body.size);
+		}
+	}
+
+	if (h->work_size > 0) {
+		if (h->worker->work (h->instance, host_work_respond, h, h->work_size, h->work_buf) != LV2_WORKER_SUCCESS) {
+			rv = -1;
+		}
+		h->work_size = 0;
+	}
+
+	h->time += n_samples;
+	if (!h->transport || h->rolling) {
+		h->frame += n_samples;
+	}
+	return rv;
+}
+
+/**
+ * process one cycle of `n_samples`.
+ * With transport enabled, a time:Position is sent at the start of each cycle.
+ * @return 0 on success, -1 if a worker job failed
+ */
+static int
+host_run (StepSeqHost* h, uint32_t n_samples, HostMidiCallback cb, void* arg)
+{
+	host_cycle_begin (h, n_samples);
+	rt_audit_begin ();
+	h->desc->run (h->instance, n_samples);
+	rt_audit_end ();
+	return host_cycle_end (h, n_samples, cb, arg);
+}
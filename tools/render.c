@@ -0,0 +1,949 @@
+/* stepseq -- render a pattern to a Standard MIDI File
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "host.h"
+#include "smf.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef TRACE
+static const char* trace_names[TRACE_N_KINDS] = {
+	"run", "update_position", "beat_machine", "midi_panic", "sort", "seek"
+};
+
+static const char* trace_args[TRACE_N_KINDS] = {
+	"n_samples", NULL, "step", NULL, "events", "step"
+};
+
+/* write the plugin's trace records as Chrome trace-event JSON */
+typedef struct {
+	FILE*    f;
+	uint32_t tail;
+	uint64_t t0;
+	uint64_t n_records;
+	uint64_t n_lost;
+} TraceWriter;
+
+static int
+trace_open (TraceWriter* tw, const char* path)
+{
+	memset (tw, 0, sizeof (TraceWriter));
+	if (!(tw->f = fopen (path, "w"))) {
+		return -1;
+	}
+	tw->t0 = monotonic_ns ();
+	fprintf (tw->f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	return 0;
+}
+
+/** convert records written since the last call, must be called before the ring wraps */
+static void
+trace_drain (TraceWriter* tw, StepSeqHost* h)
+{
+	const StepSeqTrace* tr = &((StepSeq*)h->instance)->trace;
+	if (tr->head - tw->tail > TRACE_SIZE) {
+		tw->n_lost += tr->head - tw->tail - TRACE_SIZE;
+		tw->tail = tr->head - TRACE_SIZE;
+	}
+	for (; tw->tail != tr->head; ++tw->tail) {
+		const StepSeqTraceRecord* r = &tr->rec[tw->tail & (TRACE_SIZE - 1)];
+		fprintf (tw->f, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+		         tw->n_records > 0 ? ",\n" : "", trace_names[r->kind], r->dur > 0 ? "X" : "i",
+		         (int64_t)(r->t0 - tw->t0) * 1e-3);
+		if (r->dur > 0) {
+			fprintf (tw->f, "\"dur\":%.3f,", r->dur * 1e-3);
+		} else {
+			fprintf (tw->f, "\"s\":\"t\",");
+		}
+		fprintf (tw->f, "\"pid\":1,\"tid\":1,\"args\":{\"cycle\":%u,\"frame\":%" PRIu64,
+		         r->cycle, r->frame);
+		if (trace_args[r->kind]) {
+			fprintf (tw->f, ",\"%s\":%u", trace_args[r->kind], r->arg);
+		}
+		fprintf (tw->f, "}}");
+		++tw->n_records;
+	}
+}
+
+static int
+trace_close (TraceWriter* tw)
+{
+	fprintf (tw->f, "\n]}\n");
+	return fclose (tw->f);
+}
+#endif
+
+typedef struct {
+	SMFWriter smf;
+	double    ticks_per_sample;
+	int       rv;
+#ifdef TRACE
+	TraceWriter* tw;
+#endif
+} RenderCtx;
+
+static void
+render_event (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size)
+{
+	RenderCtx* ctx = (RenderCtx*)arg;
+	/* only note events, skip MIDI clock and panic/reset messages */
+	if ((buf[0] & 0xe0) != 0x80 || size != 3) {
+		return;
+	}
+	if (smf_writer_add (&ctx->smf, port, llrint (frame * ctx->ticks_per_sample), buf, size)) {
+		ctx->rv = -1;
+	}
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* settings of one pattern, from the command line or a manifest line */
+typedef struct {
+	const char* out;
+	const char* smf_in;
+	double      bars;
+	uint32_t    blocksize;
+	int         channel;
+	int         division;
+	bool        drum_mode;
+	int         bpb;
+	int         unit;
+	double      rate;
+	double      swing;
+	double      bpm;
+
+	/* grid and note assignments are applied after the host is initialized */
+	int (*cells)[3];
+	int n_cells;
+	int n_alloc;
+	int notes[N_NOTES][2];
+	int n_notes;
+} RenderJob;
+
+typedef struct {
+	int64_t n_samples;
+	size_t  n_events;
+	double  seconds; // wall-clock time
+} RenderResult;
+
+static void
+job_init (RenderJob* job)
+{
+	memset (job, 0, sizeof (RenderJob));
+	job->bars      = 4;
+	job->blocksize = 8192;
+	job->channel   = 1;
+	job->division  = 3;
+	job->bpb       = 4;
+	job->unit      = 4;
+	job->rate      = 48000;
+	job->bpm       = 120;
+}
+
+static int
+job_copy (RenderJob* dst, const RenderJob* src)
+{
+	*dst = *src;
+	if (src->n_cells == 0) {
+		dst->cells   = NULL;
+		dst->n_alloc = 0;
+		return 0;
+	}
+	dst->cells = (int (*)[3])malloc (src->n_alloc * sizeof (src->cells[0]));
+	if (!dst->cells) {
+		return -1;
+	}
+	memcpy (dst->cells, src->cells, src->n_cells * sizeof (src->cells[0]));
+	return 0;
+}
+
+/**
+ * apply a per-pattern option.
+ * @return 0 on success, -1 for an invalid value, 1 if `c` is not a per-pattern option
+ */
+static int
+job_option (RenderJob* job, int c, const char* arg)
+{
+	switch (c) {
+		case 'b':
+			job->bars = atof (arg);
+			break;
+		case 'B':
+			job->blocksize = atoi (arg);
+			break;
+		case 'c':
+			job->channel = atoi (arg);
+			break;
+		case 'd':
+			job->division = atoi (arg);
+			break;
+		case 'D':
+			job->drum_mode = true;
+			break;
+		case 'g':
+			if (job->n_cells == job->n_alloc && job->n_cells < N_NOTES * N_STEPS) {
+				const int n_alloc = job->n_alloc ? 2 * job->n_alloc : 16;
+				int (*cells)[3] = (int (*)[3])realloc (job->cells, n_alloc * sizeof (job->cells[0]));
+				if (!cells) {
+					return -1;
+				}
+				job->cells   = cells;
+				job->n_alloc = n_alloc;
+			}
+			if (job->n_cells >= N_NOTES * N_STEPS
+			    || 3 != sscanf (arg, "%d,%d,%d", &job->cells[job->n_cells][0], &job->cells[job->n_cells][1], &job->cells[job->n_cells][2])) {
+				fprintf (stderr, "Invalid grid cell '%s'\n", arg);
+				return -1;
+			}
+			++job->n_cells;
+			break;
+		case 'i':
+			job->smf_in = arg;
+			break;
+		case 'm':
+			if (2 != sscanf (arg, "%d/%d", &job->bpb, &job->unit) || job->bpb < 1 || job->unit < 1) {
+				fprintf (stderr, "Invalid meter '%s'\n", arg);
+				return -1;
+			}
+			break;
+		case 'n':
+			if (job->n_notes >= N_NOTES
+			    || 2 != sscanf (arg, "%d,%d", &job->notes[job->n_notes][0], &job->notes[job->n_notes][1])) {
+				fprintf (stderr, "Invalid note '%s'\n", arg);
+				return -1;
+			}
+			++job->n_notes;
+			break;
+		case 'r':
+			job->rate = atof (arg);
+			break;
+		case 's':
+			job->swing = atof (arg);
+			break;
+		case 't':
+			job->bpm = atof (arg);
+			break;
+		default:
+			return 1;
+	}
+	return 0;
+}
+
+static bool
+job_valid (const RenderJob* job)
+{
+	return !(job->bars <= 0 || job->blocksize < 1 || job->rate < 8000 || job->bpm < 1 || job->channel < 1 || job->channel > 16);
+}
+
+/** render a pattern with the host `h`, on success the result is left in ctx->smf */
+static int
+render (StepSeqHost* h, const RenderJob* job, RenderCtx* ctx, RenderResult* res)
+{
+	if (host_init (h, job->rate)) {
+		fprintf (stderr, "Cannot instantiate plugin\n");
+		return -1;
+	}
+
+	host_set_transport (h, job->bpm, job->bpb, job->unit);
+	h->ports[PORT_DIVIDER] = job->division;
+	h->ports[PORT_SWING]   = job->swing;
+	h->ports[PORT_DRUM]    = job->drum_mode ? 1 : 0;
+	h->ports[PORT_CHN]     = job->channel - 1;
+	h->ports[PORT_FREEWHEEL] = 1;
+
+	for (int i = 0; i < job->n_notes; ++i) {
+		host_set_note (h, job->notes[i][0] - 1, job->notes[i][1]);
+	}
+	for (int i = 0; i < job->n_cells; ++i) {
+		host_set_cell (h, job->cells[i][0] - 1, job->cells[i][1] - 1, job->cells[i][2]);
+	}
+
+	if (job->smf_in) {
+		/* import while stopped, the pattern is applied before the first rolling cycle */
+		h->rolling = false;
+		host_load_smf (h, job->smf_in);
+		if (host_run (h, 1, NULL, NULL)) {
+			fprintf (stderr, "Cannot import '%s'\n", job->smf_in);
+			host_cleanup (h);
+			return -1;
+		}
+		h->rolling = true;
+	}
+
+	const double qbpm = job->bpm * 4.0 / job->unit;
+	ctx->ticks_per_sample = qbpm * SMF_PPQN / (60.0 * job->rate);
+	ctx->rv = 0;
+	if (smf_writer_init (&ctx->smf, N_OUTS, qbpm)) {
+		host_cleanup (h);
+		return -1;
+	}
+
+	const int64_t n_total = llrint (job->bars * job->bpb * 60.0 * job->rate / job->bpm);
+
+	const double t0 = now ();
+	while (h->frame < n_total) {
+		const uint32_t n = (n_total - h->frame) < job->blocksize ? (n_total - h->frame) : job->blocksize;
+		host_run (h, n, render_event, ctx);
+#ifdef TRACE
+		if (ctx->tw) {
+			trace_drain (ctx->tw, h);
+		}
+#endif
+	}
+
+	/* stop, to emit note-off events at the end */
+	h->rolling = false;
+	host_run (h, 1, render_event, ctx);
+	const double t1 = now ();
+
+#ifdef TRACE
+	if (ctx->tw) {
+		trace_drain (ctx->tw, h);
+	}
+#endif
+
+	host_cleanup (h);
+
+	res->n_samples = n_total;
+	res->seconds   = t1 - t0;
+	res->n_events  = 0;
+	for (uint32_t t = 0; t < ctx->smf.n_tracks; ++t) {
+		res->n_events += ctx->smf.tracks[t].n_events;
+	}
+	return 0;
+}
+
+/* ustar archive, patterns are appended in the order they are rendered */
+typedef struct {
+	FILE*           f;
+	pthread_mutex_t lock;
+	int             rv;
+} TarWriter;
+
+static int
+tar_open (TarWriter* tar, const char* path)
+{
+	tar->f  = strcmp (path, "-") ? fopen (path, "wb") : stdout;
+	tar->rv = 0;
+	if (!tar->f) {
+		return -1;
+	}
+	pthread_mutex_init (&tar->lock, NULL);
+	return 0;
+}
+
+static int
+tar_add (TarWriter* tar, const char* name, const void* data, size_t size)
+{
+	static const char zero[512] = { 0 };
+	char hdr[512];
+	memset (hdr, 0, sizeof (hdr));
+
+	/* names longer than 100 chars are split into prefix and name at a '/' */
+	const size_t len = strlen (name);
+	if (len <= 100) {
+		memcpy (hdr, name, len);
+	} else {
+		const char* sep = strchr (name + len - 101, '/');
+		if (!sep || sep - name > 155 || sep[1] == '\0') {
+			fprintf (stderr, "File name too long for archive '%s'\n", name);
+			return -1;
+		}
+		memcpy (hdr, sep + 1, len - (sep - name) - 1);
+		memcpy (hdr + 345, name, sep - name);
+	}
+	snprintf (hdr + 100, 8, "%07o", 0644);
+	snprintf (hdr + 108, 8, "%07o", 0);
+	snprintf (hdr + 116, 8, "%07o", 0);
+	snprintf (hdr + 124, 12, "%011llo", (unsigned long long)size);
+	snprintf (hdr + 136, 12, "%011llo", (unsigned long long)time (NULL));
+	hdr[156] = '0';
+	memcpy (hdr + 257, "ustar", 6);
+	memcpy (hdr + 263, "00", 2);
+
+	/* checksum, computed with the checksum field set to spaces */
+	unsigned int sum = 0;
+	memset (hdr + 148, ' ', 8);
+	for (int i = 0; i < 512; ++i) {
+		sum += (uint8_t)hdr[i];
+	}
+	snprintf (hdr + 148, 7, "%06o", sum);
+
+	const size_t pad = (512 - size % 512) % 512;
+	pthread_mutex_lock (&tar->lock);
+	if (fwrite (hdr, 512, 1, tar->f) != 1
+	    || fwrite (data, 1, size, tar->f) != size
+	    || fwrite (zero, 1, pad, tar->f) != pad) {
+		tar->rv = -1;
+	}
+	const int rv = tar->rv;
+	pthread_mutex_unlock (&tar->lock);
+	return rv;
+}
+
+static int
+tar_close (TarWriter* tar)
+{
+	static const char zero[1024] = { 0 };
+	int rv = tar->rv;
+	if (fwrite (zero, 1, sizeof (zero), tar->f) != sizeof (zero)) {
+		rv = -1;
+	}
+	if (tar->f == stdout ? fflush (tar->f) : fclose (tar->f)) {
+		rv = -1;
+	}
+	pthread_mutex_destroy (&tar->lock);
+	return rv;
+}
+
+/** write the SMF to job->out, or append it to the archive */
+static int
+render_save (const RenderCtx* ctx, const RenderJob* job, TarWriter* tar)
+{
+	if (!tar) {
+		return smf_writer_save (&ctx->smf, job->out);
+	}
+
+	char*  buf = NULL;
+	size_t len = 0;
+	FILE*  f   = open_memstream (&buf, &len);
+	if (!f) {
+		return -1;
+	}
+	int rv = smf_writer_write (&ctx->smf, f);
+	if (fclose (f)) {
+		rv = -1;
+	}
+	if (rv == 0) {
+		rv = tar_add (tar, job->out, buf, len);
+	}
+	free (buf);
+	return rv;
+}
+
+/* Batch rendering, work-stealing: every worker owns a range of jobs and
+ * takes them from the front. When its range is empty, it takes jobs from
+ * the back of another worker's range.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t        head;
+	uint32_t        tail;
+} JobRange;
+
+typedef struct {
+	const RenderJob* jobs;
+	JobRange*        ranges;
+	uint32_t         n_workers;
+	TarWriter*       tar;
+
+	pthread_mutex_t  lock;
+	uint32_t         n_done;
+	uint32_t         n_failed;
+	int64_t          n_samples;
+	size_t           n_events;
+} RenderPool;
+
+typedef struct {
+	RenderPool* pool;
+	uint32_t    id;
+	pthread_t   thread;
+} RenderWorker;
+
+static bool
+pool_take (RenderPool* pool, uint32_t id, uint32_t* job)
+{
+	for (uint32_t i = 0; i < pool->n_workers; ++i) {
+		JobRange* r = &pool->ranges[(id + i) % pool->n_workers];
+		bool found = false;
+		pthread_mutex_lock (&r->lock);
+		if (r->head < r->tail) {
+			*job  = i == 0 ? r->head++ : --r->tail;
+			found = true;
+		}
+		pthread_mutex_unlock (&r->lock);
+		if (found) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void*
+render_worker (void* arg)
+{
+	RenderWorker* w    = (RenderWorker*)arg;
+	RenderPool*   pool = w->pool;
+
+	/* every worker has its own host and plugin instance */
+	StepSeqHost* h = (StepSeqHost*)malloc (sizeof (StepSeqHost));
+	if (!h) {
+		return NULL;
+	}
+
+	uint32_t j;
+	while (pool_take (pool, w->id, &j)) {
+		const RenderJob* job = &pool->jobs[j];
+		RenderCtx    ctx;
+		RenderResult res;
+#ifdef TRACE
+		ctx.tw = NULL;
+#endif
+		int rv = render (h, job, &ctx, &res);
+		if (rv == 0) {
+			if (ctx.rv || render_save (&ctx, job, pool->tar)) {
+				fprintf (stderr, "Cannot write '%s'\n", job->out);
+				rv = -1;
+			}
+			smf_writer_free (&ctx.smf);
+		}
+
+		pthread_mutex_lock (&pool->lock);
+		++pool->n_done;
+		if (rv) {
+			++pool->n_failed;
+		} else {
+			pool->n_samples += res.n_samples;
+			pool->n_events  += res.n_events;
+		}
+		pthread_mutex_unlock (&pool->lock);
+	}
+
+	free (h);
+	return NULL;
+}
+
+static const char* short_options = "A:b:B:c:d:Dg:hi:j:m:M:n:qr:s:t:T:";
+
+/**
+ * read jobs from a manifest, one per line: the output file followed by
+ * per-pattern options, applied on top of the command line's. Empty lines
+ * and lines starting with '#' are skipped.
+ */
+static int
+load_manifest (const char* path, const RenderJob* base, RenderJob** jobs, uint32_t* n_jobs, char** text, const struct option* long_opts)
+{
+	FILE* f = fopen (path, "r");
+	if (!f) {
+		fprintf (stderr, "Cannot read '%s'\n", path);
+		return -1;
+	}
+
+	size_t len = 0;
+	size_t n_alloc = 4096;
+	*text = (char*)malloc (n_alloc);
+	while (*text) {
+		len += fread (*text + len, 1, n_alloc - len - 1, f);
+		if (len < n_alloc - 1) {
+			break;
+		}
+		n_alloc *= 2;
+		char* t = (char*)realloc (*text, n_alloc);
+		if (!t) {
+			free (*text);
+		}
+		*text = t;
+	}
+	fclose (f);
+	if (!*text) {
+		return -1;
+	}
+	(*text)[len] = '\0';
+
+	*jobs   = NULL;
+	*n_jobs = 0;
+
+	uint32_t jobs_alloc = 0;
+	int      argv_alloc = 0;
+	char**   argv = NULL;
+	int      line = 0;
+	int      rv   = 0;
+
+	for (char* l = *text; l && rv == 0; ) {
+		char* next = strchr (l, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		++line;
+
+		int argc = 1;
+		for (char* tok = strtok (l, " \t\r"); tok && rv == 0; tok = strtok (NULL, " \t\r")) {
+			if (argc == 1 && tok[0] == '#') {
+				break;
+			}
+			if (argc + 1 >= argv_alloc) {
+				argv_alloc = argv_alloc ? 2 * argv_alloc : 64;
+				char** a = (char**)realloc (argv, argv_alloc * sizeof (char*));
+				if (!a) {
+					rv = -1;
+					break;
+				}
+				argv = a;
+			}
+			argv[argc++] = tok;
+		}
+		l = next;
+		if (argc == 1 || rv) {
+			continue;
+		}
+		argv[0]    = (char*)path;
+		argv[argc] = NULL;
+
+		if (*n_jobs == jobs_alloc) {
+			jobs_alloc = jobs_alloc ? 2 * jobs_alloc : 256;
+			RenderJob* j = (RenderJob*)realloc (*jobs, jobs_alloc * sizeof (RenderJob));
+			if (!j) {
+				rv = -1;
+				break;
+			}
+			*jobs = j;
+		}
+
+		RenderJob* job = &(*jobs)[*n_jobs];
+		if (job_copy (job, base)) {
+			rv = -1;
+			break;
+		}
+		++*n_jobs;
+
+		int c;
+		optind = 0;
+		while (rv == 0 && (c = getopt_long (argc, argv, short_options, long_opts, NULL)) != -1) {
+			if (job_option (job, c, optarg)) {
+				rv = -1;
+			}
+		}
+		if (rv == 0 && optind + 1 != argc) {
+			rv = -1;
+		}
+		if (rv == 0) {
+			job->out = argv[optind];
+			if (!job_valid (job)) {
+				rv = -1;
+			}
+		}
+		if (rv) {
+			fprintf (stderr, "%s:%d: invalid render job\n", path, line);
+		}
+	}
+
+	free (argv);
+	return rv;
+}
+
+static int
+render_manifest (const RenderJob* base, const char* path, const char* archive, int n_threads, bool quiet, const struct option* long_opts)
+{
+	RenderJob* jobs   = NULL;
+	uint32_t   n_jobs = 0;
+	char*      text   = NULL;
+	TarWriter  tar;
+	int        rv = 0;
+
+	if (load_manifest (path, base, &jobs, &n_jobs, &text, long_opts)) {
+		rv = 1;
+	} else if (archive && tar_open (&tar, archive)) {
+		fprintf (stderr, "Cannot write '%s'\n", archive);
+		rv = 1;
+	}
+
+	if (rv == 0 && n_jobs > 0) {
+		if (n_threads < 1) {
+			n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+		}
+		if (n_threads < 1) {
+			n_threads = 1;
+		}
+		if ((uint32_t)n_threads > n_jobs) {
+			n_threads = n_jobs;
+		}
+
+		RenderPool pool;
+		memset (&pool, 0, sizeof (pool));
+		pool.jobs      = jobs;
+		pool.n_workers = n_threads;
+		pool.tar       = archive ? &tar : NULL;
+		pool.ranges    = (JobRange*)calloc (n_threads, sizeof (JobRange));
+		RenderWorker* workers = (RenderWorker*)calloc (n_threads, sizeof (RenderWorker));
+		pthread_mutex_init (&pool.lock, NULL);
+
+		if (!pool.ranges || !workers) {
+			n_threads = 0;
+		}
+		for (int i = 0; i < n_threads; ++i) {
+			pthread_mutex_init (&pool.ranges[i].lock, NULL);
+			pool.ranges[i].head = (uint64_t)n_jobs * i / n_threads;
+			pool.ranges[i].tail = (uint64_t)n_jobs * (i + 1) / n_threads;
+			workers[i].pool     = &pool;
+			workers[i].id       = i;
+		}
+
+		/* the main thread is worker 0, jobs of workers that fail to start are taken by others */
+		const double t0 = now ();
+		for (int i = 1; i < n_threads; ++i) {
+			if (pthread_create (&workers[i].thread, NULL, render_worker, &workers[i])) {
+				workers[i].pool = NULL;
+			}
+		}
+		if (n_threads > 0) {
+			render_worker (&workers[0]);
+		}
+		for (int i = 1; i < n_threads; ++i) {
+			if (workers[i].pool) {
+				pthread_join (workers[i].thread, NULL);
+			}
+		}
+		const double t1 = now ();
+
+		pool.n_failed += n_jobs - pool.n_done;
+		if (pool.n_failed > 0) {
+			rv = 1;
+		}
+		if (!quiet) {
+			const double sec = pool.n_samples / base->rate;
+			fprintf (stderr, "Rendered %u patterns (%.1f sec), %zu events in %.3f sec with %d thread%s (%.0fx realtime), %u failed\n",
+			         n_jobs - pool.n_failed, sec, pool.n_events, t1 - t0, n_threads, n_threads != 1 ? "s" : "",
+			         sec / (t1 - t0 > 0 ? t1 - t0 : 1e-9), pool.n_failed);
+		}
+
+		for (int i = 0; i < n_threads; ++i) {
+			pthread_mutex_destroy (&pool.ranges[i].lock);
+		}
+		pthread_mutex_destroy (&pool.lock);
+		free (pool.ranges);
+		free (workers);
+	}
+
+	if (archive && rv == 0 && tar_close (&tar)) {
+		fprintf (stderr, "Cannot write '%s'\n", archive);
+		rv = 1;
+	}
+
+	for (uint32_t i = 0; i < n_jobs; ++i) {
+		free (jobs[i].cells);
+	}
+	free (jobs);
+	free (text);
+	return rv;
+}
+
+static void
+usage (int status)
+{
+	printf ("stepseq-render - Render a step-sequencer pattern to a MIDI file.\n\n"
+	        "Usage: stepseq-render [ OPTIONS ] <output.mid>\n"
+	        "       stepseq-render [ OPTIONS ] -M <manifest>\n\n"
+	        "Options:\n"
+	        "  -A, --archive <file>     with --manifest, write all files to a tar archive\n"
+	        "                           in the order they are rendered ('-': stdout)\n"
+	        "  -b, --bars <num>         number of bars to render (default 4)\n"
+	        "  -B, --blocksize <num>    samples per run() call (default 8192)\n"
+	        "  -c, --channel <chn>      MIDI channel 1..16 (default 1)\n"
+	        "  -d, --division <num>     step duration, port value 0..9 (default 3: quarter)\n"
+	        "  -D, --drum-mode          re-trigger consecutive notes\n"
+	        "  -g, --grid <r,s,v>       set velocity of row r, step s (1-based)\n"
+	        "  -h, --help               display this help and exit\n"
+	        "  -i, --import <file.mid>  import pattern from a MIDI file\n"
+	        "  -j, --jobs <num>         with --manifest, number of threads (default: CPUs)\n"
+	        "  -m, --meter <n/d>        time signature (default 4/4)\n"
+	        "  -M, --manifest <file>    render the patterns listed in this file\n"
+	        "  -n, --note <r,n>         set MIDI note number of row r (1-based)\n"
+	        "  -q, --quiet              do not print statistics\n"
+	        "  -r, --rate <num>         sample rate (default 48000)\n"
+	        "  -s, --swing <num>        swing 0..0.5 (default 0)\n"
+	        "  -t, --bpm <num>          tempo in beats per minute (default 120)\n"
+#ifdef TRACE
+	        "  -T, --trace <file.json>  write a Chrome trace of the plugin's run()\n"
+#endif
+	        "\n"
+	        "The grid size is %dx%d (%d output%s), set at compile time.\n"
+	        "The pattern is played synced to a synthetic host transport starting at\n"
+	        "bar 1, the output is a type 1 SMF with one track per output port.\n"
+	        "\n"
+	        "A manifest has one pattern per line: the output file followed by options\n"
+	        "(-b -B -c -d -D -g -i -m -n -r -s -t), which are applied on top of the\n"
+	        "command line's. Empty lines and lines starting with '#' are ignored.\n"
+	        "Patterns are rendered in parallel, each thread has its own plugin instance.\n",
+	        N_STEPS, N_NOTES, N_OUTS, N_OUTS > 1 ? "s" : "");
+	exit (status);
+}
+
+static const struct option long_options[] = {
+	{ "archive",   required_argument, 0, 'A' },
+	{ "bars",      required_argument, 0, 'b' },
+	{ "blocksize", required_argument, 0, 'B' },
+	{ "channel",   required_argument, 0, 'c' },
+	{ "division",  required_argument, 0, 'd' },
+	{ "drum-mode", no_argument,       0, 'D' },
+	{ "grid",      required_argument, 0, 'g' },
+	{ "help",      no_argument,       0, 'h' },
+	{ "import",    required_argument, 0, 'i' },
+	{ "jobs",      required_argument, 0, 'j' },
+	{ "meter",     required_argument, 0, 'm' },
+	{ "manifest",  required_argument, 0, 'M' },
+	{ "note",      required_argument, 0, 'n' },
+	{ "quiet",     no_argument,       0, 'q' },
+	{ "rate",      required_argument, 0, 'r' },
+	{ "swing",     required_argument, 0, 's' },
+	{ "bpm",       required_argument, 0, 't' },
+#ifdef TRACE
+	{ "trace",     required_argument, 0, 'T' },
+#endif
+	{ 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	static StepSeqHost host;
+	RenderCtx    ctx;
+	RenderResult res;
+	RenderJob    job;
+
+	bool        quiet     = false;
+	const char* manifest  = NULL;
+	const char* archive   = NULL;
+	int         n_threads = 0;
+#ifdef TRACE
+	const char* trace_out = NULL;
+	TraceWriter tw;
+	tw.f = NULL;
+#endif
+
+	job_init (&job);
+
+	int c;
+	while ((c = getopt_long (argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+			case 'A':
+				archive = optarg;
+				break;
+			case 'h':
+				usage (0);
+				break;
+			case 'j':
+				n_threads = atoi (optarg);
+				break;
+			case 'M':
+				manifest = optarg;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+#ifdef TRACE
+			case 'T':
+				trace_out = optarg;
+				break;
+#endif
+			default:
+				switch (job_option (&job, c, optarg)) {
+					case 0:
+						break;
+					case 1:
+						usage (1);
+						break;
+					default:
+						return 1;
+				}
+				break;
+		}
+	}
+
+	if (manifest) {
+		if (optind != argc) {
+			usage (1);
+		}
+#ifdef TRACE
+		if (trace_out) {
+			fprintf (stderr, "Tracing is not supported with a manifest\n");
+			return 1;
+		}
+#endif
+		if (!job_valid (&job)) {
+			fprintf (stderr, "Invalid parameter\n");
+			return 1;
+		}
+		const int rv = render_manifest (&job, manifest, archive, n_threads, quiet, long_options);
+		free (job.cells);
+		return rv;
+	}
+
+	if (optind + 1 != argc || archive || n_threads) {
+		usage (1);
+	}
+	if (!job_valid (&job)) {
+		fprintf (stderr, "Invalid parameter\n");
+		return 1;
+	}
+	job.out = argv[optind];
+
+#ifdef TRACE
+	if (trace_out && trace_open (&tw, trace_out)) {
+		fprintf (stderr, "Cannot write '%s'\n", trace_out);
+		return 1;
+	}
+	ctx.tw = tw.f ? &tw : NULL;
+#endif
+
+	if (render (&host, &job, &ctx, &res)) {
+#ifdef TRACE
+		if (tw.f) {
+			trace_close (&tw);
+		}
+#endif
+		return 1;
+	}
+
+#ifdef TRACE
+	if (tw.f) {
+		if (trace_close (&tw)) {
+			fprintf (stderr, "Cannot write '%s'\n", trace_out);
+			smf_writer_free (&ctx.smf);
+			return 1;
+		} else if (!quiet) {
+			fprintf (stderr, "Traced %" PRIu64 " records, %" PRIu64 " lost\n", tw.n_records, tw.n_lost);
+		}
+	}
+#endif
+
+	if (ctx.rv || render_save (&ctx, &job, NULL)) {
+		fprintf (stderr, "Cannot write '%s'\n", job.out);
+		smf_writer_free (&ctx.smf);
+		return 1;
+	}
+
+	if (!quiet) {
+		fprintf (stderr, "Rendered %.1f bars (%.2f sec), %zu events in %.3f ms (%.0fx realtime)\n",
+		         job.bars, res.n_samples / job.rate, res.n_events, 1e3 * res.seconds,
+		         (res.n_samples / job.rate) / (res.seconds > 0 ? res.seconds : 1e-9));
+	}
+
+	smf_writer_free (&ctx.smf);
+	free (job.cells);
+	return 0;
+}
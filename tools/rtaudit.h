@@ -0,0 +1,164 @@
+/* stepseq -- real-time safety audit for the in-process host
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Calls that may block or allocate are wrapped at link-time
+ * (-Wl,--wrap=<function>, see RT_AUDIT_WRAP in the Makefile) and counted
+ * while the plugin's run() is executing. Since the plugin is compiled into
+ * the tool, every call made by the plugin is covered, calls made inside
+ * libc are not.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	RT_MALLOC = 0,
+	RT_CALLOC,
+	RT_REALLOC,
+	RT_FREE,
+	RT_POSIX_MEMALIGN,
+	RT_MUTEX_LOCK,
+	RT_MUTEX_TRYLOCK,
+	RT_COND_WAIT,
+	RT_SEM_WAIT,
+	RT_WRITE,
+	RT_READ,
+	RT_FOPEN,
+	RT_FWRITE,
+	RT_FPUTS,
+	RT_PUTS,
+	RT_PRINTF,
+	RT_FPRINTF,
+	RT_VFPRINTF,
+	RT_USLEEP,
+	RT_NANOSLEEP,
+	RT_N_CALLS
+};
+
+static const char* rt_audit_names[RT_N_CALLS] = {
+	"malloc", "calloc", "realloc", "free", "posix_memalign",
+	"pthread_mutex_lock", "pthread_mutex_trylock", "pthread_cond_wait", "sem_wait",
+	"write", "read", "fopen", "fwrite", "fputs", "puts", "printf", "fprintf", "vfprintf",
+	"usleep", "nanosleep"
+};
+
+static struct {
+	bool     in_run;
+	uint32_t calls[RT_N_CALLS];
+} rt_audit;
+
+static inline void
+rt_audit_call (int which)
+{
+	if (rt_audit.in_run) {
+		++rt_audit.calls[which];
+	}
+}
+
+#define rt_audit_begin() (rt_audit.in_run = true)
+#define rt_audit_end()   (rt_audit.in_run = false)
+
+/* the host's log is not part of the plugin, a real host provides a RT-safe one */
+#define rt_audit_pause()  const bool rt_audit_was_in_run = rt_audit.in_run; rt_audit.in_run = false
+#define rt_audit_resume() rt_audit.in_run = rt_audit_was_in_run
+
+/**
+ * print calls made in run () since the last report.
+ * @return number of calls
+ */
+static uint32_t
+rt_audit_report (const char* name)
+{
+	const bool in_run = rt_audit.in_run;
+	rt_audit.in_run = false;
+
+	uint32_t total = 0;
+	for (int i = 0; i < RT_N_CALLS; ++i) {
+		if (rt_audit.calls[i] > 0) {
+			fprintf (stderr, "FAIL: %s, %s() called %u time%s in run()\n",
+			         name, rt_audit_names[i], rt_audit.calls[i], rt_audit.calls[i] > 1 ? "s" : "");
+		}
+		total += rt_audit.calls[i];
+		rt_audit.calls[i] = 0;
+	}
+
+	rt_audit.in_run = in_run;
+	return total;
+}
+
+/* link-time wrappers */
+
+#define RT_AUDIT_WRAP(ret, fn, id, params, args) \
+	ret __real_##fn params;                        \
+	ret __wrap_##fn params                         \
+	{                                              \
+		rt_audit_call (id);                          \
+		return __real_##fn args;                     \
+	}
+
+RT_AUDIT_WRAP (void*, malloc, RT_MALLOC, (size_t s), (s))
+RT_AUDIT_WRAP (void*, calloc, RT_CALLOC, (size_t n, size_t s), (n, s))
+RT_AUDIT_WRAP (void*, realloc, RT_REALLOC, (void* p, size_t s), (p, s))
+RT_AUDIT_WRAP (int, posix_memalign, RT_POSIX_MEMALIGN, (void** p, size_t a, size_t s), (p, a, s))
+RT_AUDIT_WRAP (int, pthread_mutex_lock, RT_MUTEX_LOCK, (pthread_mutex_t* m), (m))
+RT_AUDIT_WRAP (int, pthread_mutex_trylock, RT_MUTEX_TRYLOCK, (pthread_mutex_t* m), (m))
+RT_AUDIT_WRAP (int, pthread_cond_wait, RT_COND_WAIT, (pthread_cond_t* c, pthread_mutex_t* m), (c, m))
+RT_AUDIT_WRAP (int, sem_wait, RT_SEM_WAIT, (sem_t* s), (s))
+RT_AUDIT_WRAP (ssize_t, write, RT_WRITE, (int fd, const void* b, size_t n), (fd, b, n))
+RT_AUDIT_WRAP (ssize_t, read, RT_READ, (int fd, void* b, size_t n), (fd, b, n))
+RT_AUDIT_WRAP (FILE*, fopen, RT_FOPEN, (const char* p, const char* m), (p, m))
+RT_AUDIT_WRAP (size_t, fwrite, RT_FWRITE, (const void* b, size_t s, size_t n, FILE* f), (b, s, n, f))
+RT_AUDIT_WRAP (int, fputs, RT_FPUTS, (const char* s, FILE* f), (s, f))
+RT_AUDIT_WRAP (int, puts, RT_PUTS, (const char* s), (s))
+RT_AUDIT_WRAP (int, vfprintf, RT_VFPRINTF, (FILE* f, const char* fmt, va_list ap), (f, fmt, ap))
+RT_AUDIT_WRAP (int, usleep, RT_USLEEP, (useconds_t u), (u))
+RT_AUDIT_WRAP (int, nanosleep, RT_NANOSLEEP, (const struct timespec* t, struct timespec* r), (t, r))
+
+void __real_free (void* p);
+void
+__wrap_free (void* p)
+{
+	rt_audit_call (RT_FREE);
+	__real_free (p);
+}
+
+int
+__wrap_printf (const char* fmt, ...)
+{
+	rt_audit_call (RT_PRINTF);
+	va_list ap;
+	va_start (ap, fmt);
+	const int rv = __real_vfprintf (stdout, fmt, ap);
+	va_end (ap);
+	return rv;
+}
+
+int
+__wrap_fprintf (FILE* f, const char* fmt, ...)
+{
+	rt_audit_call (RT_FPRINTF);
+	va_list ap;
+	va_start (ap, fmt);
+	const int rv = __real_vfprintf (f, fmt, ap);
+	va_end (ap);
+	return rv;
+}
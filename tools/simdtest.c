@@ -0,0 +1,136 @@
+/* stepseq -- compare a SIMD backend of the grid kernels to scalar code
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Built once per backend, with SIMD_TEST set to the backend and the
+ * backend's compiler flags (see SIMD_BACKENDS in the Makefile).
+ * Every result and every bit of the `seen` array must match scalar.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIMD_BACKEND SIMD_SCALAR
+#include "../src/simd.h"
+#undef SIMD_BACKEND
+#define SIMD_BACKEND SIMD_TEST
+#include "../src/simd.h"
+
+#if SIMD_TEST == SIMD_AVX2
+#define SIMD_NAME "avx2"
+#define grid_diff_test grid_diff_avx2
+#elif SIMD_TEST == SIMD_SSE2
+#define SIMD_NAME "sse2"
+#define grid_diff_test grid_diff_sse2
+#elif SIMD_TEST == SIMD_NEON
+#define SIMD_NAME "neon"
+#define grid_diff_test grid_diff_neon
+#else
+#define SIMD_NAME "scalar"
+#define grid_diff_test grid_diff_scalar
+#endif
+
+#define MAX_CELLS (32 * 32)
+#define N_ROUNDS 20000
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd (void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static float
+from_bits (uint32_t b)
+{
+	float f;
+	memcpy (&f, &b, sizeof (f));
+	return f;
+}
+
+/* port values: velocities, and values a host should not send, but may */
+static float
+rnd_value (void)
+{
+	static const uint32_t special[] = {
+		0x00000000, 0x80000000, // +/- 0
+		0x00000001, 0x80000001, // denormal
+		0x007fffff, 0x00800000, // largest denormal, smallest normal
+		0x7f800000, 0xff800000, // +/- inf
+		0x7fc00000, 0xffc00000, // NaN
+		0x7f800001, 0x7fffffff, // signalling NaN, NaN payload
+	};
+	switch (rnd () % 4) {
+		case 0:
+			return special[rnd () % (sizeof (special) / sizeof (special[0]))];
+		case 1:
+			return from_bits (rnd () ^ (rnd () << 24));
+		default:
+			return rnd () % 128;
+	}
+}
+
+int
+main (void)
+{
+#if SIMD_TEST == SIMD_AVX2 && (defined __GNUC__ || defined __clang__)
+	if (!__builtin_cpu_supports ("avx2")) {
+		printf ("SKIP %-6s not supported by this CPU\n", SIMD_NAME);
+		return 0;
+	}
+#endif
+
+	static float    cur[MAX_CELLS];
+	static float    seen_ref[MAX_CELLS];
+	static float    seen_test[MAX_CELLS];
+	static uint32_t changed_ref[MAX_CELLS / 32];
+	static uint32_t changed_test[MAX_CELLS / 32];
+
+	uint32_t failed = 0;
+	for (uint32_t r = 0; r < N_ROUNDS; ++r) {
+		/* all grid sizes, and partial vectors */
+		const uint32_t n = 1 + rnd () % MAX_CELLS;
+
+		/* the common case: nothing, or few values changed */
+		const uint32_t p_change = 1 + rnd () % 64;
+		for (uint32_t i = 0; i < n; ++i) {
+			seen_ref[i] = r == 0 ? from_bits (0x7fc00000) : rnd_value ();
+			cur[i]      = rnd () % p_change ? seen_ref[i] : rnd_value ();
+		}
+		memcpy (seen_test, seen_ref, sizeof (float) * n);
+		memset (changed_ref, 0, sizeof (changed_ref));
+		memset (changed_test, 0, sizeof (changed_test));
+
+		const uint32_t rv_ref  = grid_diff_scalar (cur, seen_ref, changed_ref, n);
+		const uint32_t rv_test = grid_diff_test (cur, seen_test, changed_test, n);
+
+		if (rv_ref != rv_test
+		    || memcmp (changed_ref, changed_test, sizeof (changed_ref))
+		    || memcmp (seen_ref, seen_test, sizeof (float) * n)) {
+			if (failed == 0) {
+				fprintf (stderr, "  round %u, %u cells: %u changed, expected %u\n", r, n, rv_test, rv_ref);
+			}
+			++failed;
+		}
+	}
+
+	printf ("%-4s %-6s %u rounds, %u failed\n", failed ? "FAIL" : "OK", SIMD_NAME, N_ROUNDS, failed);
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/* stepseq -- Standard MIDI File writer for tools
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SMF_PPQN 960
+
+typedef struct {
+	uint64_t tick;
+	uint8_t  buf[3];
+	uint8_t  size;
+} SMFEvent;
+
+typedef struct {
+	SMFEvent* events;
+	size_t    n_events;
+	size_t    n_alloc;
+} SMFTrack;
+
+typedef struct {
+	SMFTrack* tracks;
+	uint32_t  n_tracks;
+	double    bpm; // quarter-notes per minute
+} SMFWriter;
+
+static int
+smf_writer_init (SMFWriter* w, uint32_t n_tracks, double bpm)
+{
+	w->tracks   = (SMFTrack*)calloc (n_tracks, sizeof (SMFTrack));
+	w->n_tracks = n_tracks;
+	w->bpm      = bpm;
+	return w->tracks ? 0 : -1;
+}
+
+static void
+smf_writer_free (SMFWriter* w)
+{
+	for (uint32_t t = 0; t < w->n_tracks; ++t) {
+		free (w->tracks[t].events);
+	}
+	free (w->tracks);
+	w->tracks   = NULL;
+	w->n_tracks = 0;
+}
+
+/** add a channel message, events must be added in chronological order per track */
+static int
+smf_writer_add (SMFWriter* w, uint32_t track, uint64_t tick, const uint8_t* buf, uint32_t size)
+{
+	if (track >= w->n_tracks || size < 1 || size > 3) {
+		return -1;
+	}
+	SMFTrack* t = &w->tracks[track];
+	if (t->n_events == t->n_alloc) {
+		const size_t n_alloc = t->n_alloc ? 2 * t->n_alloc : 1024;
+		SMFEvent*    ev      = (SMFEvent*)realloc (t->events, n_alloc * sizeof (SMFEvent));
+		if (!ev) {
+			return -1;
+		}
+		t->events  = ev;
+		t->n_alloc = n_alloc;
+	}
+	SMFEvent* ev = &t->events[t->n_events++];
+	ev->tick = tick;
+	ev->size = size;
+	memcpy (ev->buf, buf, size);
+	return 0;
+}
+
+static void
+smf_put_varlen (FILE* f, uint64_t v)
+{
+	uint8_t  b[10];
+	int      n = 0;
+	b[n++] = v & 0x7f;
+	while (v >>= 7) {
+		b[n++] = 0x80 | (v & 0x7f);
+	}
+	while (n > 0) {
+		fputc (b[--n], f);
+	}
+}
+
+static void
+smf_put_be (FILE* f, uint32_t v, int len)
+{
+	for (int i = len - 1; i >= 0; --i) {
+		fputc ((v >> (8 * i)) & 0xff, f);
+	}
+}
+
+/** write a track chunk, the length is filled in afterwards */
+static void
+smf_write_track (FILE* f, const SMFTrack* t, double bpm)
+{
+	fputs ("MTrk", f);
+	const long len_pos = ftell (f);
+	smf_put_be (f, 0, 4);
+
+	uint64_t last = 0;
+	if (!t) {
+		/* tempo track */
+		const uint32_t us_per_quarter = 60e6 / bpm;
+		smf_put_varlen (f, 0);
+		fputc (0xff, f); fputc (0x51, f); fputc (0x03, f);
+		smf_put_be (f, us_per_quarter, 3);
+	} else {
+		for (size_t i = 0; i < t->n_events; ++i) {
+			const SMFEvent* ev = &t->events[i];
+			smf_put_varlen (f, ev->tick - last);
+			fwrite (ev->buf, 1, ev->size, f);
+			last = ev->tick;
+		}
+	}
+
+	/* end of track */
+	smf_put_varlen (f, 0);
+	fputc (0xff, f); fputc (0x2f, f); fputc (0x00, f);
+
+	const long end = ftell (f);
+	fseek (f, len_pos, SEEK_SET);
+	smf_put_be (f, end - len_pos - 4, 4);
+	fseek (f, end, SEEK_SET);
+}
+
+/** write a type 1 SMF, a tempo track followed by one track per output */
+static int
+smf_writer_write (const SMFWriter* w, FILE* f)
+{
+	fputs ("MThd", f);
+	smf_put_be (f, 6, 4);
+	smf_put_be (f, 1, 2);
+	smf_put_be (f, w->n_tracks + 1, 2);
+	smf_put_be (f, SMF_PPQN, 2);
+
+	smf_write_track (f, NULL, w->bpm);
+	for (uint32_t t = 0; t < w->n_tracks; ++t) {
+		smf_write_track (f, &w->tracks[t], w->bpm);
+	}
+	return ferror (f) ? -1 : 0;
+}
+
+static int
+smf_writer_save (const SMFWriter* w, const char* path)
+{
+	FILE* f = fopen (path, "wb");
+	if (!f) {
+		return -1;
+	}
+	int rv = smf_writer_write (w, f);
+	if (fclose (f)) {
+		rv = -1;
+	}
+	return rv;
+}
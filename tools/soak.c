@@ -0,0 +1,258 @@
+/* stepseq -- long-run timing drift test
+ *
+ * Copyright (C) 2016 Robin Gareus <robin@gareus.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every step plays a note, the n-th note-on is step n. Its ideal position
+ * is n * (samples per step) from the start, without rounding. A step must be
+ * played at the ideal position rounded down. The only tolerance is the
+ * plugin's internal time resolution (SOAK_TOLERANCE): a step that ideally
+ * falls within that distance of a sample boundary may be on either side.
+ */
+
+#include "host.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define SOAK_TOLERANCE (2.0 / TIME_GRID)
+
+enum {
+	SOAK_FREE = 0,   // free running
+	SOAK_HOST,       // host transport, time:Position every cycle
+	SOAK_HOST_SPARSE // host transport, time:Position only when the transport changes
+};
+
+static const char* soak_modes[] = { "free", "host", "host-sparse" };
+
+typedef struct {
+	double   sps;    // ideal samples per step
+	double   origin; // sample-time of step 0
+	uint64_t steps;
+	uint64_t boundary; // steps close to a sample boundary, rounded up
+	uint64_t errors;
+	double   min_err;
+	double   max_err;
+	bool     verbose;
+	int      mode;
+	double   rate;
+	bool     past_event;
+} SoakCtx;
+
+static void
+soak_event (void* arg, uint32_t port, int64_t frame, const uint8_t* buf, uint32_t size)
+{
+	SoakCtx* ctx = (SoakCtx*)arg;
+	if (size != 3 || (buf[0] & 0xf0) != 0x90 || buf[2] == 0) {
+		return;
+	}
+	const double ideal = ctx->origin + ctx->steps * ctx->sps;
+	const double err   = frame - ideal; // (-1, 0] when rounded down
+
+	if (err < ctx->min_err) {
+		ctx->min_err = err;
+	}
+	if (err > ctx->max_err) {
+		ctx->max_err = err;
+	}
+
+	if (err > -1 - SOAK_TOLERANCE && err <= SOAK_TOLERANCE) {
+		if (err > 0 || err <= -1) {
+			++ctx->boundary;
+		}
+	} else {
+		if (ctx->verbose || ctx->errors == 0) {
+			fprintf (stderr, "  %s @ %.0fHz: step %" PRIu64 " at %" PRId64 ", expected %.6f (%+.6f samples, after %.2f hours)\n",
+			         soak_modes[ctx->mode], ctx->rate, ctx->steps, frame, ideal, err, frame / ctx->rate / 3600.0);
+		}
+		++ctx->errors;
+	}
+	++ctx->steps;
+}
+
+static void
+soak_log (void* arg, int64_t frame, const char* msg)
+{
+	SoakCtx* ctx = (SoakCtx*)arg;
+	fprintf (stderr, "  %s @ %.0fHz: %.2f hours: %s\n", soak_modes[ctx->mode], ctx->rate, frame / ctx->rate / 3600.0, msg);
+	if (strstr (msg, "Past event")) {
+		ctx->past_event = true;
+	}
+}
+
+static int
+soak (int mode, double rate, double bpm, int division, double hours, uint32_t blocksize, bool verbose)
+{
+	static StepSeqHost host;
+	StepSeqHost* h = &host;
+	SoakCtx ctx;
+
+	if (host_init (h, rate)) {
+		fprintf (stderr, "Cannot instantiate plugin\n");
+		return -1;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.mode    = mode;
+	ctx.rate    = rate;
+	ctx.verbose = verbose;
+
+	h->log_cb  = soak_log;
+	h->log_arg = &ctx;
+
+	/* the tempo is transmitted as float, use the same value for the ideal position */
+	const float fbpm = bpm;
+
+	h->ports[PORT_DIVIDER] = division;
+	if (mode == SOAK_FREE) {
+		h->ports[PORT_BPM] = fbpm;
+	} else {
+		host_set_transport (h, fbpm, 4, 4);
+		h->pos_on_change = mode == SOAK_HOST_SPARSE;
+	}
+	for (uint32_t s = 0; s < N_STEPS; ++s) {
+		host_set_cell (h, s % N_NOTES, s, 100);
+	}
+
+	ctx.sps = rate * 60.0 * parse_division (division, 4.0) / fbpm;
+	/* when free-running, the first step is played one loop after the tempo
+	 * is set, the first loop's duration is rounded to TIME_GRID */
+	ctx.origin = mode == SOAK_FREE ? N_STEPS * snap_time (ctx.sps) : 0;
+
+	/* random block sizes, deterministic for a given rate */
+	uint32_t seed = rate;
+	const int64_t n_total = llrint (hours * 3600.0 * rate);
+	while (h->time < n_total) {
+		uint32_t n = blocksize;
+		if (n == 0) {
+			seed = seed * 1103515245 + 12345;
+			n = 1 + (seed >> 8) % 4096;
+		}
+		if (n > n_total - h->time) {
+			n = n_total - h->time;
+		}
+		host_run (h, n, soak_event, &ctx);
+	}
+
+	const uint32_t seeks = h->ports[PORT_SEEKS];
+	host_cleanup (h);
+
+	const int rv = (ctx.errors > 0 || seeks > 0 || ctx.past_event || ctx.steps < 2) ? 1 : 0;
+
+	printf ("%-4s %-11s %6.0fHz %7.2f BPM: %9" PRIu64 " steps, error %+.6f..%+.6f, %" PRIu64 " at a boundary, %" PRIu64 " errors, %u seeks\n",
+	        rv ? "FAIL" : "OK", soak_modes[mode], rate, fbpm, ctx.steps, ctx.min_err, ctx.max_err, ctx.boundary, ctx.errors, seeks);
+	fflush (stdout);
+	return rv;
+}
+
+static void
+usage (int status)
+{
+	printf ("stepseq-soak - Simulate long continuous playback and check for drift.\n\n"
+	        "Usage: stepseq-soak [ OPTIONS ]\n\n"
+	        "Options:\n"
+	        "  -B, --blocksize <num>    samples per run() call (default 0: random 1..4096)\n"
+	        "  -d, --division <num>     step duration, port value 0..9 (default 1: 1/16)\n"
+	        "  -h, --help               display this help and exit\n"
+	        "  -H, --hours <num>        duration of playback (default 24)\n"
+	        "  -r, --rate <num>         test only this sample rate\n"
+	        "  -t, --bpm <num>          tempo in beats per minute (default 93.7)\n"
+	        "  -v, --verbose            report every misplaced step\n"
+	        "\n"
+	        "Free-running and host-synced playback (with time:Position sent every cycle\n"
+	        "and only on transport changes) are simulated at 44.1, 48 and 96 kHz.\n"
+	        "Every step must be played at its ideal sample-position, rounded down.\n"
+	        "A step ideally within %g samples of a sample boundary may be on either side.\n",
+	        SOAK_TOLERANCE);
+	exit (status);
+}
+
+static const struct option long_options[] = {
+	{ "blocksize", required_argument, 0, 'B' },
+	{ "division",  required_argument, 0, 'd' },
+	{ "help",      no_argument,       0, 'h' },
+	{ "hours",     required_argument, 0, 'H' },
+	{ "rate",      required_argument, 0, 'r' },
+	{ "bpm",       required_argument, 0, 't' },
+	{ "verbose",   no_argument,       0, 'v' },
+	{ 0, 0, 0, 0 }
+};
+
+int
+main (int argc, char** argv)
+{
+	static const double rates[] = { 44100, 48000, 96000 };
+
+	double   bpm       = 93.7;
+	double   hours     = 24;
+	double   rate      = 0;
+	int      division  = 1;
+	uint32_t blocksize = 0;
+	bool     verbose   = false;
+
+	int c;
+	while ((c = getopt_long (argc, argv, "B:d:hH:r:t:v", long_options, NULL)) != -1) {
+		switch (c) {
+			case 'B':
+				blocksize = atoi (optarg);
+				break;
+			case 'd':
+				division = atoi (optarg);
+				break;
+			case 'h':
+				usage (0);
+				break;
+			case 'H':
+				hours = atof (optarg);
+				break;
+			case 'r':
+				rate = atof (optarg);
+				break;
+			case 't':
+				bpm = atof (optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage (1);
+				break;
+		}
+	}
+
+	if (optind != argc || hours <= 0 || bpm < 1 || division < 0 || division > 9 || (rate != 0 && rate < 8000)) {
+		usage (1);
+	}
+
+	const double t0 = time (NULL);
+	int failed = 0;
+	int tested = 0;
+	for (uint32_t r = 0; r < sizeof (rates) / sizeof (rates[0]); ++r) {
+		if (rate != 0 && r > 0) {
+			break;
+		}
+		for (int m = SOAK_FREE; m <= SOAK_HOST_SPARSE; ++m) {
+			if (soak (m, rate != 0 ? rate : rates[r], bpm, division, hours, blocksize, verbose)) {
+				++failed;
+			}
+			++tested;
+		}
+	}
+
+	printf ("Simulated %d x %.1f hours in %.0f sec, %d failed\n", tested, hours, difftime (time (NULL), t0), failed);
+	return failed > 0 ? 1 : 0;
+}